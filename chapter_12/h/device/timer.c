@@ -5,17 +5,55 @@
 #include "interrupt.h"
 #include "thread.h"
 #include "debug.h"
+#include "global.h"
+#include "list.h"
 
 #define IRQ0_FREQUENCY	    100    //定义我们想要的中断发生频率，100HZ                         
 #define INPUT_FREQUENCY	    1193180     //计数器0的工作脉冲信号评率
-#define COUNTER0_VALUE	    INPUT_FREQUENCY / IRQ0_FREQUENCY
+#define COUNTER0_VALUE	    (INPUT_FREQUENCY / IRQ0_FREQUENCY)
 #define CONTRER0_PORT	    0x40        //要写入初值的计数器端口号
 #define COUNTER0_NO	        0   //要操作的计数器的号码
 #define COUNTER_MODE	    2   //用在控制字中设定工作模式的号码，这里表示比率发生器
 #define READ_WRITE_LATCH    3   //用在控制字中设定读/写/锁存操作位，这里表示先写入低字节，然后写入高字节
 #define PIT_CONTROL_PORT    0x43    //控制字寄存器的端口
 
+#ifndef TICKLESS
+#define TICKLESS 0	    // 为1时计数器0工作在单次定时方式,只在下一个时间片到期或睡眠线程到期时才发时钟中断
+#endif
+#define COUNTER_MODE_ONESHOT 0      // 方式0,计数到0时OUT变高,发出一次中断后就不再发
+#define PIT_READ_BACK	    0xc2    // 读回命令:同时锁存计数器0的状态字节和当前计数值
+#define PIT_STATUS_OUT	    0x80    // 状态字节中的OUT引脚电平,单次定时中为1表示已经计到0
+#define PIT_STATUS_NULL     0x40    // 为1表示新写入的初值还没装入计数器,此时读到的计数值无效
+#define MAX_SHOT_TICKS	    (0xffff / COUNTER0_VALUE)	// 16位计数器一次最多能定多少个嘀嗒,100HZ时为5
+
+#define mil_seconds_per_intr (1000 / IRQ0_FREQUENCY)   // 每次时钟中断间隔的毫秒数
+
+/* 分层时间轮:第0层256个槽,每槽1个嘀嗒;其上3层各64个槽,每层一个槽覆盖下一层的整圈.
+ * 线程按到期嘀嗒放进能容纳其剩余时间的最低一层,高层槽在下一层转满一圈时才被"降级"(cascade)到低层,
+ * 所以每个睡眠线程最多被搬动3次,时钟中断处理平摊下来是O(1) */
+#define TW_ROOT_BITS   8
+#define TW_LEVEL_BITS  6
+#define TW_ROOT_SIZE   (1 << TW_ROOT_BITS)
+#define TW_LEVEL_SIZE  (1 << TW_LEVEL_BITS)
+#define TW_ROOT_MASK   (TW_ROOT_SIZE - 1)
+#define TW_LEVEL_MASK  (TW_LEVEL_SIZE - 1)
+#define TW_LEVELS      3
+#define TW_LEVEL_SHIFT(n)  (TW_ROOT_BITS + (n) * TW_LEVEL_BITS)   // 第n个高层(从0算)槽号在到期嘀嗒中的起始位
+#define TW_MAX_TICKS   ((1 << TW_LEVEL_SHIFT(TW_LEVELS)) - 1)      // 时间轮能表示的最长睡眠,约7.7天
+
 uint32_t ticks;          // ticks是内核自中断开启以来总共的嘀嗒数
+uint32_t idle_ticks;     // 其中cpu处于idle线程中的嘀嗒数,ticks - idle_ticks就是cpu真正忙的时间(单cpu,只有一份)
+uint32_t timer_intr_cnt; // 实际发生的时钟中断次数,周期方式下等于ticks,单次方式下与ticks之比就是省掉的中断
+
+#if TICKLESS
+static uint16_t shot_counts;	   // 本次单次定时装入的初值
+static uint32_t counts_acc;	   // 已经走过但还不够一个嘀嗒的计数值
+static uint32_t shot_end_tick;	   // 本次单次定时到期时ticks应有的值
+static bool timer_busy;		   // 正在结算嘀嗒,结算中thread_unblock不能再重入timer_rearm
+#endif
+
+static struct list tw_root[TW_ROOT_SIZE];                  // 第0层时间轮
+static struct list tw_levels[TW_LEVELS][TW_LEVEL_SIZE];     // 高层时间轮
 
 /* 把操作的计数器counter_no、读写锁属性rwl、计数器模式counter_mode写入模式控制寄存器并赋予初始值counter_value */
 static void frequency_set(uint8_t counter_port, \
@@ -33,30 +71,209 @@ static void frequency_set(uint8_t counter_port, \
    outb(counter_port, (uint8_t) (counter_value>>8) );
 }
 
+/* 把线程按其wake_tick挂到时间轮上合适的槽,须在关中断下调用 */
+static void timer_wheel_add(struct task_struct* pthread) {
+   uint32_t expire = pthread->wake_tick;
+   uint32_t delta = expire - ticks;
+   struct list* slot;
+   if (delta < TW_ROOT_SIZE) {
+      slot = &tw_root[expire & TW_ROOT_MASK];
+   } else {
+      uint32_t level = 0;
+      while (delta >= (uint32_t)1 << TW_LEVEL_SHIFT(level + 1)) {
+	 level++;
+      }
+      slot = &tw_levels[level][(expire >> TW_LEVEL_SHIFT(level)) & TW_LEVEL_MASK];
+   }
+   list_append(slot, &pthread->timer_tag);
+}
+
+/* 把第level个高层时间轮第idx个槽中的线程重新放回时间轮,此时它们都会落到更低的层上 */
+static void timer_wheel_cascade(uint32_t level, uint32_t idx) {
+   struct list* slot = &tw_levels[level][idx];
+   while (!list_empty(slot)) {
+      struct task_struct* pthread = elem2entry(struct task_struct, timer_tag, list_pop(slot));
+      timer_wheel_add(pthread);
+   }
+}
+
+/* 时间轮走过一个嘀嗒:需要时先从高层降级,再唤醒第0层当前槽中到期的线程 */
+static void timer_wheel_advance(void) {
+   uint32_t level = 0;
+   while (level < TW_LEVELS && (ticks & (((uint32_t)1 << TW_LEVEL_SHIFT(level)) - 1)) == 0) {
+      uint32_t idx = (ticks >> TW_LEVEL_SHIFT(level)) & TW_LEVEL_MASK;
+      timer_wheel_cascade(level, idx);
+      if (idx != 0) {	// 本层还没转完一圈,更高层不用动
+	 break;
+      }
+      level++;
+   }
+
+   struct list* slot = &tw_root[ticks & TW_ROOT_MASK];
+   while (!list_empty(slot)) {
+      struct task_struct* pthread = elem2entry(struct task_struct, timer_tag, list_pop(slot));
+      ASSERT(pthread->wake_tick == ticks);
+      thread_unblock(pthread);
+   }
+}
+
+/* 结算一个嘀嗒,返回cur的时间片是否已经用完 */
+static bool timer_tick(struct task_struct* cur) {
+   cur->elapsed_ticks++;	  // 记录此线程占用的cpu时间嘀
+   ticks++;	  //从内核第一次处理时间中断后开始至今的滴哒数,内核态和用户态总共的嘀哒数
+   if (cur == idle_thread) {
+      idle_ticks++;
+   }
+   timer_wheel_advance();	  // 唤醒到期的睡眠线程,若它们级别更高,下面就会被调度
+
+   if (cur->ticks == 0) {
+      return true;
+   }
+   cur->ticks--;		  // 将当前进程的时间片-1
+   return false;
+}
+
+#if TICKLESS
+/* 下一次单次定时该定几个嘀嗒 */
+static uint32_t timer_next_shot(void) {
+   if (!thread_ready_empty()) {	  // 有线程在等cpu,就得逐个嘀嗒地数时间片
+      return 1;
+   }
+   /* 只有当前线程能运行,时间片到期也还是选中它,只需要在最近的睡眠线程到期时醒来.
+    * 高层时间轮在第0层转满一圈时要降级,不能跨过这个时刻,所以第0层往后看就够了 */
+   uint32_t limit = TW_ROOT_SIZE - (ticks & TW_ROOT_MASK);
+   if (limit > MAX_SHOT_TICKS) {
+      limit = MAX_SHOT_TICKS;
+   }
+   uint32_t shot;
+   for (shot = 1; shot < limit; shot++) {
+      if (!list_empty(&tw_root[(ticks + shot) & TW_ROOT_MASK])) {
+	 break;
+      }
+   }
+   return shot;
+}
+
+/* 通过读回命令得到本次单次定时开始后计数器已经走过的计数值 */
+static uint32_t pit_elapsed_counts(void) {
+   outb(PIT_CONTROL_PORT, PIT_READ_BACK);
+   uint8_t status = inb(CONTRER0_PORT);
+   uint16_t count = inb(CONTRER0_PORT);
+   count |= (uint16_t)inb(CONTRER0_PORT) << 8;
+   if (status & PIT_STATUS_NULL) {
+      return 0;
+   }
+   if (status & PIT_STATUS_OUT) {	  // 已经计到0,此后计数器从0xffff继续往下减
+      return shot_counts + (uint16_t)(0 - count);
+   }
+   return shot_counts - count;
+}
+
+/* 把已经过去的整嘀嗒全部结算掉,再按当前状态开始下一次单次定时,须在关中断下调用.
+ * 下一次定时总是对齐到嘀嗒边界,不足一个嘀嗒的余数留在counts_acc中,所以ticks不会漂移.
+ * 返回结算期间cur的时间片是否用完 */
+static bool timer_sync(struct task_struct* cur) {
+   bool expired = false;
+   timer_busy = true;
+   counts_acc += pit_elapsed_counts();
+   while (counts_acc >= COUNTER0_VALUE) {
+      counts_acc -= COUNTER0_VALUE;
+      if (timer_tick(cur)) {
+	 if (thread_ready_empty()) {   // 没有别的线程可选,调度也只会选回cur,直接续上时间片
+	    cur->ticks = cur->priority;
+	    cur->boost = 0;
+	 } else {
+	    expired = true;
+	 }
+      }
+   }
+   uint32_t shot = timer_next_shot();
+   shot_end_tick = ticks + shot;
+   shot_counts = shot * COUNTER0_VALUE - counts_acc;
+   frequency_set(CONTRER0_PORT, COUNTER0_NO, READ_WRITE_LATCH, COUNTER_MODE_ONESHOT, shot_counts);
+   timer_busy = false;
+   return expired;
+}
+#endif
+
+/* 有线程进入就绪队列或睡眠队列后调用:单次方式下若下一次时钟中断该提前,就立即结算并重新定时 */
+void timer_rearm(void) {
+#if TICKLESS
+   enum intr_status old_status = intr_disable();
+   if (!timer_busy && timer_next_shot() < shot_end_tick - ticks) {
+      timer_sync(running_thread());
+   }
+   intr_set_status(old_status);
+#endif
+}
+
 /* 时钟的中断处理函数 */
 static void intr_timer_handler(void) {
    struct task_struct* cur_thread = running_thread();
 
    ASSERT(cur_thread->stack_magic == 0x19870916);         // 检查栈是否溢出
 
-   cur_thread->elapsed_ticks++;	  // 记录此线程占用的cpu时间嘀
-   ticks++;	  //从内核第一次处理时间中断后开始至今的滴哒数,内核态和用户态总共的嘀哒数
+   timer_intr_cnt++;
+#if TICKLESS
+   bool expired = timer_sync(cur_thread);	  // 一次中断可能对应多个嘀嗒
+#else
+   bool expired = timer_tick(cur_thread);
+#endif
 
-   if (cur_thread->ticks == 0) {	  // 若进程时间片用完就开始调度新的进程上cpu
+ /* 若进程时间片用完,或者唤醒了级别更高的线程,就开始调度新的进程上cpu */
+   if (expired || thread_need_resched()) {
       schedule(); 
    } 
-   else {				  // 将当前进程的时间片-1
-      cur_thread->ticks--;
-   }
 }
 
 
 
+/* 让当前线程睡眠sleep_ticks个嘀嗒,期间不占用cpu,至少睡1个嘀嗒 */
+void thread_sleep(uint32_t sleep_ticks) {
+   if (sleep_ticks == 0) {
+      sleep_ticks = 1;
+   } else if (sleep_ticks > TW_MAX_TICKS) {
+      sleep_ticks = TW_MAX_TICKS;
+   }
+   enum intr_status old_status = intr_disable();
+   struct task_struct* cur = running_thread();
+   ASSERT(cur->status == TASK_RUNNING);
+#if TICKLESS
+   timer_sync(cur);	  // 先把ticks追到当前时刻,否则算出的wake_tick会偏早
+#endif
+   cur->wake_tick = ticks + sleep_ticks;
+   timer_wheel_add(cur);
+   timer_rearm();
+   thread_block(TASK_BLOCKED);	  // 到期后由时钟中断thread_unblock唤醒
+   intr_set_status(old_status);
+}
+
+/* 以毫秒为单位的sleep,不足一个嘀嗒的部分向上取整 */
+void mtime_sleep(uint32_t m_seconds) {
+   thread_sleep(DIV_ROUND_UP(m_seconds, mil_seconds_per_intr));
+}
+
 /* 初始化PIT8253 */
 void timer_init() {
    put_str("timer_init start\n");
+#if TICKLESS
+   /* 先定一个嘀嗒,以后每次中断时再按需要重新定时 */
+   shot_counts = COUNTER0_VALUE;
+   shot_end_tick = 1;
+   frequency_set(CONTRER0_PORT, COUNTER0_NO, READ_WRITE_LATCH, COUNTER_MODE_ONESHOT, shot_counts);
+#else
    /* 设置8253的定时周期,也就是发中断的周期 */
    frequency_set(CONTRER0_PORT, COUNTER0_NO, READ_WRITE_LATCH, COUNTER_MODE, COUNTER0_VALUE);
+#endif
+   uint32_t slot_idx, level;
+   for (slot_idx = 0; slot_idx < TW_ROOT_SIZE; slot_idx++) {
+      list_init(&tw_root[slot_idx]);
+   }
+   for (level = 0; level < TW_LEVELS; level++) {
+      for (slot_idx = 0; slot_idx < TW_LEVEL_SIZE; slot_idx++) {
+	 list_init(&tw_levels[level][slot_idx]);
+      }
+   }
    register_handler(0x20, intr_timer_handler);
    put_str("timer_init done\n");
 }
\ No newline at end of file
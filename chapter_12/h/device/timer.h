@@ -1,5 +1,12 @@
 #ifndef __DEVICE_TIME_H
 #define __DEVICE_TIME_H
+#include "stdint.h"
+extern uint32_t ticks;
+extern uint32_t idle_ticks;
+extern uint32_t timer_intr_cnt;
 void timer_init(void);
+void thread_sleep(uint32_t sleep_ticks);
+void mtime_sleep(uint32_t m_seconds);
+void timer_rearm(void);
 #endif
 
@@ -6,14 +6,27 @@ void panic_spin(char* filename, int line, const char* func, const char* conditio
 //__FILE__,__LINE__,__func__是预定义宏，代表这个宏所在的文件名，行数，与函数名字，编译器处理
 #define PANIC(...) panic_spin (__FILE__, __LINE__, __func__, __VA_ARGS__)
 
+/* 不变量检查级别,编译时用gcc -DDEBUG_LEVEL=n指定,makefile中的DEBUG_LEVEL变量会传进来
+ * 0 发行版,ASSERT全部失效,链表结点也不带owner标签
+ * 1 默认,ASSERT生效,链表成员检查elem_in_list靠list_elem中的owner标签,O(1)
+ * 2 调试版,elem_in_list在查owner标签的同时再用elem_find遍历整个链表,两者不一致就PANIC,用来排查标签本身的错误 */
+#ifndef DEBUG_LEVEL
+#define DEBUG_LEVEL 1
+#endif
+
 //如果定义了NDEBUG,那么下面定义的ASSERT就是个空。这样我们可以便捷的让所有ASSERT宏失效。因为有时候断言太多，程序会运行
-//很慢。我们如果不想要ASSERT起作用，编译时用gcc-DNDEBUG就行了
+//很慢。我们如果不想要ASSERT起作用，编译时用gcc-DNDEBUG就行了,效果与DEBUG_LEVEL为0相同
 #ifdef NDEBUG
+   #undef DEBUG_LEVEL
+   #define DEBUG_LEVEL 0
+#endif
+
+#if DEBUG_LEVEL == 0
    #define ASSERT(CONDITION) ((void)0)
 #else
 #define ASSERT(CONDITION)   \
     if(CONDITION){}         \
     else{PANIC(#CONDITION);}    //加#后，传入的参数变成字符串
 
-#endif  //结束#ifdef NDEBUG
+#endif  //结束#if DEBUG_LEVEL == 0
 #endif  //结束#define __KERNEL_DEBUG_H
@@ -83,6 +83,7 @@ struct gdt_desc {
 #define true 1
 #define false 0
 #define DIV_ROUND_UP(X, STEP) ((X + STEP - 1) / (STEP))  //用于向上取整的宏，如9/10=1
+#define UNUSED __attribute__ ((unused))     //标记有意不使用的参数
 
 //定义eflages寄存器用的一些字段，含义见书p511
 #define EFLAGS_MBS	(1 << 1)	// 此项必须要设置
@@ -8,13 +8,18 @@
 #include "keyboard.h"
 #include "tss.h"
 #include "syscall-init.h"
+#include "string.h"
+#include "process.h"
 
 /*负责初始化所有模块 */
 void init_all() {
    put_str("init_all\n");
+   string_init();    // 按cpu支持的指令选定内存操作函数的实现
    idt_init();	     // 初始化中断
    mem_init();	     // 初始化内存管理系统
    thread_init();    // 初始化线程相关结构
+   process_init();   // 初始化用户进程相关结构
+   page_zeroer_init();   // 启动后台清0页框的线程
    timer_init();     // 初始化PIT
    console_init();   // 控制台初始化最好放在开中断之前
    keyboard_init();  // 键盘初始化
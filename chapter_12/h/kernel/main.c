@@ -6,13 +6,20 @@
 #include "process.h"
 #include "syscall-init.h"
 #include "syscall.h"
+#include "malloc.h"
 #include "stdio.h"
 #include "memory.h"
+#include "timer.h"
+#include "slab.h"
+#include "perf.h"
 
 void k_thread_a(void*);
 void k_thread_b(void*);
 void u_prog_a(void);
 void u_prog_b(void);
+#if PERF_STATS
+void k_thread_perf(void*);
+#endif
 
 int main(void) {
    put_str("I am kernel\n");
@@ -22,7 +29,11 @@ int main(void) {
    process_execute(u_prog_b, "u_prog_b");
    thread_start("k_thread_a", 31, k_thread_a, "I am thread_a");
    thread_start("k_thread_b", 31, k_thread_b, "I am thread_b");
-   while(1);
+#if PERF_STATS
+   thread_start("k_thread_perf", 31, k_thread_perf, NULL);
+#endif
+/* 主线程已无事可做,阻塞自己把cpu让出来,没有任务可运行时由idle线程停机 */
+   thread_block(TASK_BLOCKED);
    return 0;
 }
 
@@ -39,12 +50,13 @@ void k_thread_a(void* arg) {
    console_put_int((int)addr3);
    console_put_char('\n');
 
-   int cpu_delay = 9999999;
-   while(cpu_delay-- > 0);
+   mtime_sleep(1000);
    sys_free(addr1);
    sys_free(addr2);
    sys_free(addr3);
-   while(1);
+   while(1) {
+      mtime_sleep(1000);
+   }
 }
 
 /* 在线程中运行的函数 */
@@ -60,27 +72,79 @@ void k_thread_b(void* arg) {
    console_put_int((int)addr3);
    console_put_char('\n');
 
-   int cpu_delay = 999999;
-   while(cpu_delay-- > 0);
+   mtime_sleep(100);
    sys_free(addr1);
    sys_free(addr2);
    sys_free(addr3);
-   while(1);
+   while(1) {
+      mtime_sleep(1000);
+   }
 }
 
+#if PERF_STATS
+#define PERF_ROUNDS 1000
+
+/* 性能计数版的测试负载:各分配路径各跑PERF_ROUNDS轮,周期数记在perf.c的计数里,
+ * 之后每10秒由malloc_stats打印一次,中间其它线程的调度与唤醒也一并计入 */
+void k_thread_perf(void* arg UNUSED) {
+   static void* objs[16];
+   struct kmem_cache* cache = kmem_cache_create("perf", 64, 0, NULL);
+   uint32_t round, i, pg_cnt;
+   mtime_sleep(2000);      // 等其它线程的输出打印完
+   for (round = 0; round < PERF_ROUNDS; round++) {
+      /* 同样大小的对象,slab与sys_malloc对比 */
+      for (i = 0; i < 16; i++) {
+         objs[i] = kmem_cache_alloc(cache);
+      }
+      for (i = 0; i < 16; i++) {
+         kmem_cache_free(cache, objs[i]);
+      }
+      for (i = 0; i < 16; i++) {
+         objs[i] = sys_malloc(64);
+      }
+      for (i = 0; i < 16; i++) {
+         sys_free(objs[i]);
+      }
+   }
+   /* 映射与解除映射的反复,1页、16页、256页各一组 */
+   for (pg_cnt = 1; pg_cnt <= 256; pg_cnt *= 16) {
+      for (round = 0; round < PERF_ROUNDS / 10; round++) {
+         void* vaddr = get_kernel_pages(pg_cnt);
+         if (vaddr != NULL) {
+            free_kernel_pages(vaddr, pg_cnt);
+         }
+      }
+   }
+   while(1) {
+      malloc_stats();
+      mtime_sleep(10000);
+   }
+}
+#endif
+
 /* 测试用户进程 */
 void u_prog_a(void) {
    void* addr1 = malloc(256);
    void* addr2 = malloc(255);
    void* addr3 = malloc(254);
    printf(" prog_a malloc addr:0x%x,0x%x,0x%x\n", (int)addr1, (int)addr2, (int)addr3);
+#if PERF_STATS
+   /* 用户态的malloc/free多数在进程自己的arena里完成,不陷入内核,内核的计数看不到,这里自己计时 */
+   uint32_t round;
+   uint64_t start = rdtsc();
+   for (round = 0; round < PERF_ROUNDS; round++) {
+      free(malloc(64));
+   }
+   printf(" prog_a malloc+free: %d cycles\n", (uint32_t)(rdtsc() - start) / PERF_ROUNDS);
+#endif
 
-   int cpu_delay = 100000;
-   while(cpu_delay-- > 0);
+   sleep(10);
    free(addr1);
    free(addr2);
    free(addr3);
-   while(1);
+   while(1) {
+      sleep(1000);
+   }
 }
 
 /* 测试用户进程 */
@@ -90,10 +154,11 @@ void u_prog_b(void) {
    void* addr3 = malloc(254);
    printf(" prog_b malloc addr:0x%x,0x%x,0x%x\n", (int)addr1, (int)addr2, (int)addr3);
 
-   int cpu_delay = 100000;
-   while(cpu_delay-- > 0);
+   sleep(10);
    free(addr1);
    free(addr2);
    free(addr3);
-   while(1);
+   while(1) {
+      sleep(1000);
+   }
 }
@@ -6,38 +6,200 @@
 #include "sync.h"
 #include "thread.h"
 #include "interrupt.h"
+#include "console.h"
+#include "stdio.h"
+#include "process.h"
+#include "vma.h"
+#include "slab.h"
+#include "vmem.h"
+#include "perf.h"
 
 #define PG_SIZE 4096    //一页的大小
-#define MEM_BITMAP_BASE 0xc009a000  //这个地址是位图的起始地址，1MB内存布局中，9FBFF是最大一段可用区域的边界，而我们计划这个可用空间最后的位置将来用来
-        //放PCB，而PCB占用内存是一个自然页，所以起始地址必须是0xxxx000这种形式，离0x9fbff最近的符合这个形式的地址是0x9f000。我们又为了将来可能的拓展，
-        // 所以让位图可以支持管理512MB的内存空间，所以预留位图大小为16KB，也就是4页，所以选择0x9a000作为位图的起始地址
 
-//定义内核堆区起始地址，堆区就是用来进行动态内存分配的地方，咱们的系统内核运行在c00000000开始的1MB虚拟地址空间，所以自然要跨过这个空间，
-//堆区的起始地址并没有跨过256个页表，没关系，反正使用虚拟地址最终都会被我们的页表转换为物理地址，我们建立物理映射的时候，跳过256个页表就行了
-#define K_HEAP_START 0xc0100000
+//定义内核堆区起始地址，堆区就是用来进行动态内存分配的地方。0xc0000000开始的4MB在loader中一一映射为物理0~4MB的全局页(768号页目录项),
+//内核、页目录表和loader建的页表都在里面，所以堆区从769号页目录项管理的0xc0400000开始，用loader预先建好的页表做4KB映射
+#define K_HEAP_START 0xc0400000
+
+#define CR4_PGE 0x80              // cr4中的全局页使能位
+#define TLB_FLUSH_THRESHOLD 32    // 一次撤销映射的页数超过它就整个刷新tlb,而不是逐页invlpg
+#define PF_ERR_USER 0x4           // 缺页错误码的U/S位,为1表示缺页发生在用户态
+
+#define ZERO_POOL_PAGES 64        // 预先清0备用的页框数
+#define KERNEL_MIN_DIV 8          // 内核的保底是全部页框的1/8
+#define ZEROER_PRIO 2             // 后台清0线程的优先级,只比idle线程高,有正经活干的线程都先于它运行
 
 /* 内存仓库arena元信息 */
 struct arena {
-   struct mem_block_desc* desc;	 // 此arena关联的mem_block_desc
-   uint32_t cnt;
-   bool large;		   /* large为ture时,cnt表示的是页框数。否则cnt表示空闲mem_block数量 */
+   uint32_t desc_idx;	 // 此arena所属规格在内存块描述符数组中的下标,存下标而不是指针,fork出的子进程继承这页时仍然有效
+   uint32_t cnt;                  // arena中空闲mem_block的数量
+   uint32_t carved;               // 已经从arena中切出过的块数,相当于bump指针,后面的块还没有用过
+   struct mem_block* free_head;   // 切出后又被释放的块组成的单链表
+   struct list_elem arena_elem;   // arena中还有空闲块时,用它挂在desc->free_list上
 };
 
 struct mem_block_desc k_block_descs[DESC_CNT];	// 内核内存块描述符数组
+static struct large_table k_large;		// 内核大块内存的描述符,用户进程的在各自pcb的u_large中
+static struct kmem_cache* large_cache;	// 大块内存描述符的对象缓存
+
+/* 各规格内存块的大小,2的幂之间插入了1.5倍的中间规格,减少例如257字节要占用512字节块这样的浪费 */
+static const uint16_t block_sizes[DESC_CNT] = {16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024};
+
+/* 申请字节数到规格下标的映射表,以16字节为粒度,第i项是能容纳i*16字节的最小规格,sys_malloc查一次表就能找到规格 */
+static uint8_t size_to_desc[MAX_BLOCK_SIZE / 16 + 1];
+
+/* 物理页框区:所有可分配的页框都由这一个伙伴系统管理,内核与用户进程按各自的保底和上限从中取用,
+ * free_area[k]链表中挂着所有2^k个页框大小的空闲块(以块首页的struct page为结点),
+ * 分配时从够用的最低阶取块并把多出来的一半逐阶挂回,释放时与伙伴块逐阶合并.
+ * 这些操作都很短,用关中断互斥,内核与用户两边的分配者不必再共用一把锁 */
+struct zone {
+   struct page* pages;                    // 页框描述符数组,第i项对应物理地址phy_addr_start + i * PG_SIZE
+   uint32_t page_cnt;                     // 管理的页框数
+   uint32_t free_pages;                   // 伙伴系统中空闲的页框数
+   struct list free_area[MAX_ORDER + 1];  // 各阶空闲块链表
+   uint32_t phy_addr_start;	     // 所管理物理内存的起始地址
+   struct list zeroed_list;              // 后台线程预先清0的页框,用struct page的free_elem串起来,它们已经从伙伴系统中取出
+   uint32_t zeroed_cnt;                  // zeroed_list中的页框数
+};
 
-/* 核心数据结构，物理内存池， 生成两个实例用于管理内核物理内存池和用户物理内存池 */
+/* 核心数据结构,物理内存池,生成两个实例分别代表内核和用户进程这两个页框的使用者.
+ * 页框不再按地址对半分给两边,而是谁要谁拿:每方不超过自己的上限,
+ * 并且要给对方留够它还没用满的保底,内核的保底保证用户进程吃光内存时内核仍然能申请到页框 */
 struct pool {
-   struct bitmap pool_bitmap;	 // 本内存池用到的位图结构,用于管理物理内存
-   uint32_t phy_addr_start;	     // 本内存池所管理物理内存的起始地址
-   uint32_t pool_size;		    // 本内存池字节容量
+   uint32_t used_pages;             // 当前占用的页框数
+   uint32_t min_pages;              // 保底页框数
+   uint32_t max_pages;              // 上限页框数
+   uint32_t peak_pages;             // 统计用:占用的最高值
+   uint32_t fail_cnt;               // 统计用:因为上限或对方的保底而申请失败的次数
    struct lock lock;		 // 申请内存时互斥
 };
 
-struct pool kernel_pool, user_pool;      //为kernel与user分别建立物理内存池，让用户进程只能从user内存池获得新的内存空间，
-        //以免申请完所有可用空间,内核就不能申请空间了
-struct virtual_addr kernel_vaddr;	 // 用于管理内核虚拟地址空间
+static struct zone mem_zone;
+struct pool kernel_pool, user_pool;      //为kernel与user分别建立物理内存池,用于记账和互斥,页框都来自mem_zone
+static struct vmem kernel_vmem;      // 内核堆的虚拟地址
+struct page* mem_map;                // 所有可分配页框的描述符数组
+uint32_t tlb_flush_threshold = TLB_FLUSH_THRESHOLD;	// 运行时可调
+uint32_t page_table_cnt;             // 统计用:所有进程现存的用户页表页数
+uint32_t zero_hits, zero_misses;     // 统计用:要清0的单页分配从清零页框池中拿到与没拿到的次数
+static struct semaphore zeroer_sema; // 清零页框池满了时后台清0线程睡在这上面
+static bool zeroer_idle;             // 后台清0线程是否正在或即将睡眠,分配者据此决定要不要唤醒它
+static uint32_t kmap_vaddr;          // 临时映射用的KMAP_SLOTS个内核虚拟页,内核没有映射全部物理内存,要访问当前地址空间外的页框时借它映射一下
+
+static bool page_table_add(void* _vaddr, void* _page_phyaddr);
+static void page_unmap(enum pool_flags pf, void* _vaddr, uint32_t pg_cnt);
+static void vaddr_remove(enum pool_flags pf, void* _vaddr, uint32_t pg_cnt);
+
+/* 把页框区中下标为idx、阶为order的空闲块挂到对应阶的空闲链表上 */
+static void free_area_add(struct zone* zone, uint32_t idx, uint32_t order) {
+   struct page* pg = &zone->pages[idx];
+   pg->order = order;
+   pg->flags |= PAGE_BUDDY;
+   list_push(&zone->free_area[order], &pg->free_elem);
+}
+
+/* 初始化页框区的伙伴系统:把所有页框按能对齐的最大块切开挂入空闲链表 */
+static void buddy_init(struct zone* zone) {
+   uint32_t order, idx = 0;
+   for (order = 0; order <= MAX_ORDER; order++) {
+      list_init(&zone->free_area[order]);
+   }
+   while (idx < zone->page_cnt) {
+      order = MAX_ORDER;
+      /* 块首下标必须是块大小的整数倍,且块不能越过页框区末尾 */
+      while ((idx & ((1 << order) - 1)) || idx + (1 << order) > zone->page_cnt) {
+         order--;
+      }
+      free_area_add(zone, idx, order);
+      idx += 1 << order;
+   }
+   zone->free_pages = zone->page_cnt;
+}
+
+/* 从页框区中分配2^order个物理上连续的页框,成功返回块首页框下标,失败返回-1 */
+static int32_t buddy_alloc(struct zone* zone, uint32_t order) {
+   uint32_t cur_order = order;
+   while (cur_order <= MAX_ORDER && list_empty(&zone->free_area[cur_order])) {  // 找有空闲块的最低阶
+      cur_order++;
+   }
+   if (cur_order > MAX_ORDER) {
+      return -1;
+   }
+   struct page* pg = elem2entry(struct page, free_elem, list_pop(&zone->free_area[cur_order]));
+   pg->flags &= ~PAGE_BUDDY;
+   uint32_t idx = pg - zone->pages;
+
+   /* 块比需要的大,就一分为二,后一半挂回低一阶的链表,直到大小刚好 */
+   while (cur_order > order) {
+      cur_order--;
+      free_area_add(zone, idx + (1 << cur_order), cur_order);
+   }
+   zone->free_pages -= 1 << order;
+   return idx;
+}
+
+/* 把下标为idx、阶为order的块还给页框区,并与空闲的伙伴块逐阶合并 */
+static void buddy_free(struct zone* zone, uint32_t idx, uint32_t order) {
+   ASSERT(idx < zone->page_cnt && !(zone->pages[idx].flags & PAGE_BUDDY));
+   zone->free_pages += 1 << order;
+   while (order < MAX_ORDER) {
+      uint32_t buddy_idx = idx ^ (1 << order);     // 伙伴块的块首下标只在第order位上与本块不同
+      if (buddy_idx >= zone->page_cnt) {
+         break;
+      }
+      struct page* buddy = &zone->pages[buddy_idx];
+      if (!(buddy->flags & PAGE_BUDDY) || buddy->order != order) {   // 伙伴不空闲或者没有合并成同样大小,不能合并
+         break;
+      }
+      list_remove(&buddy->free_elem);
+      buddy->flags &= ~PAGE_BUDDY;
+      idx &= ~(1 << order);       // 合并后的块首是两者中靠前的那个
+      order++;
+   }
+   free_area_add(zone, idx, order);
+}
+
+/* 把从下标idx开始的cnt个页框还给页框区,按能对齐的最大块分段释放 */
+static void buddy_free_range(struct zone* zone, uint32_t idx, uint32_t cnt) {
+   while (cnt > 0) {
+      uint32_t order = 0;
+      while (order < MAX_ORDER && !(idx & (1 << order)) && (2u << order) <= cnt) {
+         order++;
+      }
+      buddy_free(zone, idx, order);
+      idx += 1 << order;
+      cnt -= 1 << order;
+   }
+}
 
-//初始化内核物理内存池与用户物理内存池
+/* 使用者m_pool想再占用cnt个页框:不能超过它的上限,分配后空闲的页框(含清零页框池里的)也不能少于另一方还没用满的保底.
+ * 可以的话记到它的账上并返回true.须关中断调用 */
+static bool pool_charge(struct pool* m_pool, uint32_t cnt) {
+   struct pool* other = m_pool == &kernel_pool ? &user_pool : &kernel_pool;
+   uint32_t other_reserve = other->used_pages < other->min_pages ? other->min_pages - other->used_pages : 0;
+   uint32_t avail = mem_zone.free_pages + mem_zone.zeroed_cnt;
+   if (m_pool->used_pages + cnt > m_pool->max_pages || avail < cnt + other_reserve) {
+      m_pool->fail_cnt++;
+      return false;
+   }
+   m_pool->used_pages += cnt;
+   if (m_pool->used_pages > m_pool->peak_pages) {
+      m_pool->peak_pages = m_pool->used_pages;
+   }
+   return true;
+}
+
+/* 把下标为idx的页框交给使用者m_pool,返回其物理地址.页框已经从伙伴系统或清零页框池中取出并记过账 */
+static uint32_t frame_claim(struct pool* m_pool, uint32_t idx) {
+   struct page* pg = &mem_zone.pages[idx];
+   pg->ref_cnt = 1;
+   if (m_pool == &user_pool) {
+      pg->flags |= PAGE_USER;
+   } else {
+      pg->flags &= ~PAGE_USER;
+   }
+   return mem_zone.phy_addr_start + idx * PG_SIZE;
+}
+
+//初始化物理页框区以及内核与用户这两个使用者
 static void mem_pool_init(uint32_t all_mem) {
    	put_str("   mem_pool_init start\n");
    	uint32_t page_table_size = PG_SIZE * 256;	  // 页表大小= 1页的页目录表+第0和第768个页目录项指向同一个页表+
@@ -45,63 +207,48 @@ static void mem_pool_init(uint32_t all_mem) {
    	uint32_t used_mem = page_table_size + 0x100000;	  // 已使用内存 = 1MB + 256个页表
    	uint32_t free_mem = all_mem - used_mem;
    	uint16_t all_free_pages = free_mem / PG_SIZE;        //将所有可用内存转换为页的数量，内存分配以页为单位，丢掉的内存不考虑
-   	uint16_t kernel_free_pages = all_free_pages / 2;     //可用内存是用户与内核各一半，所以分到的页自然也是一半
-   	uint16_t user_free_pages = all_free_pages - kernel_free_pages;   //用于存储用户空间分到的页
-
-/* 为简化位图操作，余数不处理，坏处是这样做会丢内存。
-好处是不用做内存的越界检查,因为位图表示的内存少于实际物理内存*/
-   	uint32_t kbm_length = kernel_free_pages / 8;			  // 内核物理内存池的位图长度,位图中的一位表示一页,以字节为单位
-   	uint32_t ubm_length = user_free_pages / 8;			  // 用户物理内存池的位图长度.
-
-   	uint32_t kp_start = used_mem;				  // Kernel Pool start,内核使用的物理内存池的起始地址
-   	uint32_t up_start = kp_start + kernel_free_pages * PG_SIZE;	  // User Pool start,用户使用的物理内存池的起始地址
-
-   	kernel_pool.phy_addr_start = kp_start;       //赋值给内核使用的物理内存池的起始地址
-   	user_pool.phy_addr_start   = up_start;       //赋值给用户使用的物理内存池的起始地址
-
-   	kernel_pool.pool_size = kernel_free_pages * PG_SIZE;     //赋值给内核使用的物理内存池的总大小
-   	user_pool.pool_size	 = user_free_pages * PG_SIZE;       //赋值给用户使用的物理内存池的总大小
-
-   	kernel_pool.pool_bitmap.btmp_bytes_len = kbm_length;     //赋值给管理内核使用的物理内存池的位图长度
-   	user_pool.pool_bitmap.btmp_bytes_len	  = ubm_length;   //赋值给管理用户使用的物理内存池的位图长度
-
-/*********    内核内存池和用户内存池位图   ***********
- *   位图是全局的数据，长度不固定。
- *   全局或静态的数组需要在编译时知道其长度，
- *   而我们需要根据总内存大小算出需要多少字节。
- *   所以改为指定一块内存来生成位图.
- *   ************************************************/
-// 内核使用的最高地址是0xc009f000,这是主线程的栈地址.(内核的大小预计为70K左右)
-// 32M内存占用的位图是2k.内核内存池的位图先定在MEM_BITMAP_BASE(0xc009a000)处.
-   	kernel_pool.pool_bitmap.bits = (void*)MEM_BITMAP_BASE;      //管理内核使用的物理内存池的位图起始地址
-							       
-/* 用户内存池的位图紧跟在内核内存池位图之后 */
-   	user_pool.pool_bitmap.bits = (void*)(MEM_BITMAP_BASE + kbm_length);     //管理用户使用的物理内存池的位图起始地址
+
+/* 伙伴系统要为每个页框准备一个struct page,这个描述符数组放在可用内存的最前面,
+ * 占用的页框不再参与分配,并映射到内核堆的起始处 */
+   	uint32_t mem_map_pages = DIV_ROUND_UP(all_free_pages * sizeof(struct page), PG_SIZE);
+   	all_free_pages -= mem_map_pages;
+   	uint32_t zone_start = used_mem + mem_map_pages * PG_SIZE;	  // 可分配的物理内存的起始地址
+   	mem_zone.phy_addr_start = zone_start;
+   	mem_zone.page_cnt = all_free_pages;
+
+/* 两个使用者的上限都是全部页框,内核另有保底,用户进程怎么申请也要给内核留下这么多;
+ * 用户进程没有保底,内核可以用到用户进程一页也拿不到,但内核本身用不了多少 */
+   	kernel_pool.min_pages = all_free_pages / KERNEL_MIN_DIV;
+   	kernel_pool.max_pages = all_free_pages;
+   	user_pool.min_pages = 0;
+   	user_pool.max_pages = all_free_pages;
+
+   /* 内核堆的虚拟地址交给vmem管理,以页为单位.内核最多可以用到全部页框,所以堆的大小与全部可分配的页框（加上mem_map所占的页）相同，
+    * 因为虚拟内存最终都要转换为真实的物理内存，可用虚拟内存大小超过可用物理内存大小在我们这个简单操作系统无意义 */
+   	vmem_create(&kernel_vmem, "kernel_heap", K_HEAP_START, (mem_map_pages + all_free_pages) * PG_SIZE, PG_SIZE, NULL, 0);
+
+/* 把mem_map用到的页框映射到内核堆最前面,内核堆所在的页目录项在loader中都已建好,不会再去申请页表 */
+   	vmem_xalloc(&kernel_vmem, K_HEAP_START, mem_map_pages * PG_SIZE);
+   	uint32_t pg_idx;
+   	for (pg_idx = 0; pg_idx < mem_map_pages; pg_idx++) {
+   		page_table_add((void*)(K_HEAP_START + pg_idx * PG_SIZE), (void*)(used_mem + pg_idx * PG_SIZE));
+   	}
+   	mem_map = (struct page*)K_HEAP_START;
+   	memset(mem_map, 0, mem_map_pages * PG_SIZE);
+   	mem_zone.pages = mem_map;
+
    /******************** 输出内存池信息 **********************/
-   	put_str("      kernel_pool_bitmap_start:");put_int((int)kernel_pool.pool_bitmap.bits);
-   	put_str(" kernel_pool_phy_addr_start:");put_int(kernel_pool.phy_addr_start);
-   	put_str("\n");
-   	put_str("      user_pool_bitmap_start:");put_int((int)user_pool.pool_bitmap.bits);
-   	put_str(" user_pool_phy_addr_start:");put_int(user_pool.phy_addr_start);
+   	put_str("      mem_map_start:");put_int((int)mem_zone.pages);
+   	put_str(" phy_addr_start:");put_int(mem_zone.phy_addr_start);
+   	put_str(" page_cnt:");put_int(mem_zone.page_cnt);
    	put_str("\n");
 
-   /* 将位图置0*/
-   	bitmap_init(&kernel_pool.pool_bitmap);
-   	bitmap_init(&user_pool.pool_bitmap);
+   /* 将所有页框挂入伙伴系统 */
+   	buddy_init(&mem_zone);
+   	list_init(&mem_zone.zeroed_list);
 
 	lock_init(&kernel_pool.lock);
    	lock_init(&user_pool.lock);
-
-   /* 下面初始化内核虚拟地址的位图,按实际物理内存大小生成数组。*/
-   	kernel_vaddr.vaddr_bitmap.btmp_bytes_len = kbm_length;      // 赋值给管理内核可以动态使用的虚拟地址池（堆区）的位图长度，
-         //其大小与管理内核可使用的物理内存池位图长度相同，因为虚拟内存最终都要转换为真实的物理内存，可用虚拟内存大小超过可用物理内存大小在
-         //我们这个简单操作系统无意义（现代操作系统中有意义，因为我们可以把真实物理内存不断换出，回收，来让可用物理内存变相变大)
-
-  /* 位图的数组指向一块未使用的内存,目前定位在内核内存池和用户内存池之外*/
-   	kernel_vaddr.vaddr_bitmap.bits = (void*)(MEM_BITMAP_BASE + kbm_length + ubm_length);   //赋值给管理内核可以动态使用的虚拟内存池（堆区）的位图起始地址
-
-   	kernel_vaddr.vaddr_start = K_HEAP_START;     //赋值给内核可以动态使用的虚拟地址空间的起始地址
-   	bitmap_init(&kernel_vaddr.vaddr_bitmap);     //初始化管理内核可以动态使用的虚拟地址池的位图
    	put_str("   mem_pool_init done\n");
 }
 
@@ -109,50 +256,167 @@ static void mem_pool_init(uint32_t all_mem) {
 /* 在pf表示的虚拟内存池中申请pg_cnt个虚拟页,
  * 成功则返回虚拟页的起始地址, 失败则返回NULL */
 static void* vaddr_get(enum pool_flags pf, uint32_t pg_cnt) {
-   	int vaddr_start = 0, bit_idx_start = -1;
-   	uint32_t cnt = 0;
+   	uint32_t vaddr_start = 0;
    	if (pf == PF_KERNEL) {
-      	bit_idx_start  = bitmap_scan(&kernel_vaddr.vaddr_bitmap, pg_cnt);
-      	if (bit_idx_start == -1) {
+      	PERF_BEGIN(t);
+      	vaddr_start = vmem_alloc(&kernel_vmem, pg_cnt * PG_SIZE);
+      	PERF_END(PERF_VMEM_ALLOC, t);
+      	if (vaddr_start == 0) {
 	 		return NULL;
       	}
-      	while(cnt < pg_cnt) {
-	 		bitmap_set(&kernel_vaddr.vaddr_bitmap, bit_idx_start + cnt++, 1);
-      	}
-      	vaddr_start = kernel_vaddr.vaddr_start + bit_idx_start * PG_SIZE;
    	} 
 	else {	     // 用户内存池	
       	struct task_struct* cur = running_thread();
-      	bit_idx_start  = bitmap_scan(&cur->userprog_vaddr.vaddr_bitmap, pg_cnt);
-      	if (bit_idx_start == -1) {
+      	PERF_BEGIN(t);
+      	vaddr_start = vma_alloc(&cur->userprog_vmas, pg_cnt, VM_READ | VM_WRITE);
+      	PERF_END(PERF_VMA_ALLOC, t);
+      	if (vaddr_start == 0) {
 	 		return NULL;
     	}
-   		while(cnt < pg_cnt) {
-	 		bitmap_set(&cur->userprog_vaddr.vaddr_bitmap, bit_idx_start + cnt++, 1);
-     	}
-      	vaddr_start = cur->userprog_vaddr.vaddr_start + bit_idx_start * PG_SIZE;
 
-   		/* (0xc0000000 - PG_SIZE)做为用户3级栈已经在start_process被分配 */
-      	ASSERT((uint32_t)vaddr_start < (0xc0000000 - PG_SIZE));
+   		/* 栈底以下USER_STACK_SIZE的范围留给向下增长的用户3级栈,再往下一页是用户态malloc的状态页 */
+      	ASSERT((uint32_t)vaddr_start + pg_cnt * PG_SIZE <= USER_HEAP_VADDR);
    }
    return (void*)vaddr_start;
 }
 
-/* 在m_pool指向的物理内存池中分配1个物理页,
- * 成功则返回页框的物理地址,失败则返回NULL */
+/* 把pf表示的虚拟内存池中以vaddr起始的pg_cnt页原地扩展add页,紧接着的地址被占用时返回false,
+ * realloc原地扩展大块时用它占下紧接着的地址 */
+static bool vaddr_grow(enum pool_flags pf, uint32_t vaddr, uint32_t pg_cnt, uint32_t add) {
+	if (pf == PF_KERNEL) {
+		return vmem_grow(&kernel_vmem, vaddr, add * PG_SIZE);
+	}
+	struct task_struct* cur = running_thread();
+	uint32_t end = vaddr + pg_cnt * PG_SIZE;
+	return vma_try_insert(&cur->userprog_vmas, end, end + add * PG_SIZE, VM_READ | VM_WRITE);
+}
+
+/* 把pf表示的虚拟内存池中以vaddr起始的一段地址拆成前keep_pages页和其余部分,之后可以单独归还后一部分.
+ * 用户地址本来就可以从区域中间挖掉一段,不用拆;内核的拆不开时返回false */
+static bool vaddr_split(enum pool_flags pf, uint32_t vaddr, uint32_t keep_pages) {
+	return pf != PF_KERNEL || vmem_split(&kernel_vmem, vaddr, keep_pages * PG_SIZE);
+}
+
+/* 给已经记过账的使用者m_pool取1个物理页,伙伴系统空了就用清零页框池里备用的,返回页框的物理地址.
+ * 记账时算上了清零页框池,所以一定取得到,调用者需关中断 */
+static void* frame_take(struct pool* m_pool) {
+   	int32_t pg_idx = buddy_alloc(&mem_zone, 0);    // 从伙伴系统要一个0阶块,也就是一页
+   	if (pg_idx == -1) {
+      	pg_idx = elem2entry(struct page, free_elem, list_pop(&mem_zone.zeroed_list)) - mem_zone.pages;
+      	mem_zone.zeroed_cnt--;
+   	}
+   	return (void*)frame_claim(m_pool, pg_idx);
+}
+
+/* 为使用者m_pool分配1个物理页,成功则返回页框的物理地址,失败则返回NULL */
 static void* palloc(struct pool* m_pool) {
-   /* 扫描或设置位图要保证原子操作 */
-   	int bit_idx = bitmap_scan(&m_pool->pool_bitmap, 1);    // 找一个物理页面
-   	if (bit_idx == -1 ) {
-      	return NULL;
+   	PERF_BEGIN(t);
+   	void* page_phyaddr = NULL;
+   	enum intr_status old_status = intr_disable();
+   	if (pool_charge(m_pool, 1)) {
+   		page_phyaddr = frame_take(m_pool);
+   	}
+   	intr_set_status(old_status);
+   	PERF_END(PERF_PALLOC, t);
+   	return page_phyaddr;
+}
+
+/* 唤醒睡眠中的后台清0线程 */
+static void zeroer_kick(void) {
+   	if (zeroer_idle) {
+   		zeroer_idle = false;
+   		sema_up(&zeroer_sema);
+   	}
+}
+
+/* 从清零页框池中取一个页框给使用者m_pool,成功返回其物理地址,池空了返回NULL,由调用者自己分配再清0 */
+static void* zeroed_palloc(struct pool* m_pool) {
+   	void* page_phyaddr = NULL;
+   	enum intr_status old_status = intr_disable();
+   	if (list_empty(&mem_zone.zeroed_list)) {
+   		zero_misses++;
+   	} 
+   	else if (pool_charge(m_pool, 1)) {
+   		struct page* pg = elem2entry(struct page, free_elem, list_pop(&mem_zone.zeroed_list));
+   		mem_zone.zeroed_cnt--;
+   		zero_hits++;
+   		page_phyaddr = (void*)frame_claim(m_pool, pg - mem_zone.pages);
+   	}
+   	zeroer_kick();
+   	intr_set_status(old_status);
+   	return page_phyaddr;
+}
+
+/* 后台清0线程:从伙伴系统取页框,借自己专用的kmap槽清0后放入清零页框池,
+ * 把清0的开销从分配路径上挪到没事可干的时候.池满了或内存耗尽时睡眠,等分配者取走页框时唤醒.
+ * 池里的页框不记在任何使用者的账上,记账时当作空闲页框.
+ * 只有取页框和入池时关中断,清0时开着中断,可以被时钟抢占,正在清0的这一页暂时既不在伙伴系统也不在池里 */
+static void page_zeroer(void* arg UNUSED) {
+   	while (1) {
+   		enum intr_status old_status = intr_disable();
+   		int32_t pg_idx = -1;
+   		if (mem_zone.zeroed_cnt < ZERO_POOL_PAGES) {
+   			pg_idx = buddy_alloc(&mem_zone, 0);   // 不用palloc,免得又从清零页框池里拿
+   		}
+   		if (pg_idx == -1) {
+   			zeroer_idle = true;
+   			intr_set_status(old_status);
+   			sema_down(&zeroer_sema);
+   			continue;
+   		}
+   		intr_set_status(old_status);
+   		memset(kmap(KMAP_ZERO, mem_zone.phy_addr_start + pg_idx * PG_SIZE), 0, PG_SIZE);
+   		kunmap(KMAP_ZERO);
+   		intr_disable();
+   		list_append(&mem_zone.zeroed_list, &mem_zone.pages[pg_idx].free_elem);
+   		mem_zone.zeroed_cnt++;
+   		intr_set_status(old_status);
+   	}
+}
+
+/* 启动后台清0线程,须在thread_init之后调用 */
+void page_zeroer_init(void) {
+   	sema_init(&zeroer_sema, 0);
+   	thread_start("zeroer", ZEROER_PRIO, page_zeroer, NULL);
+}
+
+/* 得到物理地址pg_phy_addr所在页框的描述符 */
+static struct page* phy_to_page(uint32_t pg_phy_addr) {
+   	return &mem_zone.pages[(pg_phy_addr - mem_zone.phy_addr_start) / PG_SIZE];
+}
+
+/* 使tlb中虚拟地址vaddr所在页的表项失效 */
+static inline void invlpg(uint32_t vaddr) {
+   	asm volatile ("invlpg %0" : : "m" (*(char*)vaddr) : "memory");
+}
+
+/* 刷新整个tlb.用户空间的表项重新加载cr3就能冲掉,global为真时还要冲掉内核的全局页,得把cr4.PGE关掉再打开 */
+static void tlb_flush_all(bool global) {
+   	uint32_t cr4;
+   	asm volatile ("movl %%cr4, %0" : "=r" (cr4));
+   	if (global && (cr4 & CR4_PGE)) {
+   		asm volatile ("movl %0, %%cr4; movl %1, %%cr4" : : "r" (cr4 & ~CR4_PGE), "r" (cr4) : "memory");
+   	} 
+	else {
+   		asm volatile ("movl %%cr3, %%eax; movl %%eax, %%cr3" : : : "eax", "memory");
+   	}
+}
+
+/* 使从vaddr开始pg_cnt页的tlb表项失效:页数不超过tlb_flush_threshold时逐页invlpg,
+ * 再多的话逐页invlpg的开销就比整个刷新后重新装入tlb还大了 */
+static void tlb_flush_range(uint32_t vaddr, uint32_t pg_cnt) {
+   	if (pg_cnt > tlb_flush_threshold) {
+   		tlb_flush_all(vaddr >= 0xc0000000);
+   		return;
+   	}
+   	while (pg_cnt-- > 0) {
+   		invlpg(vaddr);
+   		vaddr += PG_SIZE;
    	}
-   	bitmap_set(&m_pool->pool_bitmap, bit_idx, 1);	// 将此位bit_idx置1
-   	uint32_t page_phyaddr = ((bit_idx * PG_SIZE) + m_pool->phy_addr_start);
-   	return (void*)page_phyaddr;
 }
 
-#define PDE_IDX(addr) ((addr & 0xffc00000) >> 22)
-#define PTE_IDX(addr) ((addr & 0x003ff000) >> 12)
+#define PDE_IDX(addr) (((addr) & 0xffc00000) >> 22)
+#define PTE_IDX(addr) (((addr) & 0x003ff000) >> 12)
 
 /* 得到虚拟地址vaddr对应的pde的指针 */
 uint32_t* pde_ptr(uint32_t vaddr) {
@@ -169,11 +433,14 @@ uint32_t* pte_ptr(uint32_t vaddr) {
 }
 
 
-/* 页表中添加虚拟地址_vaddr与物理地址_page_phyaddr的映射 */
-static void page_table_add(void* _vaddr, void* _page_phyaddr) {
+/* 页表中添加虚拟地址_vaddr与物理地址_page_phyaddr的映射,要新建页表却申请不到页框时什么也不改并返回false.
+ * 内核堆的页表在loader中都已建好,只有映射用户地址时才可能失败 */
+static bool page_table_add(void* _vaddr, void* _page_phyaddr) {
    	uint32_t vaddr = (uint32_t)_vaddr, page_phyaddr = (uint32_t)_page_phyaddr;
    	uint32_t* pde = pde_ptr(vaddr);
    	uint32_t* pte = pte_ptr(vaddr);
+   	/* 内核空间只许内核访问;它为各进程共享,做成全局页,切换进程时不必重新加载 */
+   	uint32_t attr = vaddr >= 0xc0000000 ? PG_US_S | PG_G : PG_US_U;
 
 /************************   注意   *************************
  * 执行*pte,会访问到空的pde。所以确保pde创建完成后才能执行*pte,
@@ -182,9 +449,12 @@ static void page_table_add(void* _vaddr, void* _page_phyaddr) {
    /* 先在页目录内判断目录项的P位，若为1,则表示该表已存在 */
    	if (*pde & 0x00000001) {	 // 页目录项和页表项的第0位为P,此处判断目录项是否存在
       	ASSERT(!(*pte & 0x00000001));
+      	if (vaddr < 0xc0000000) {
+      		phy_to_page(*pde & 0xfffff000)->pte_cnt++;
+      	}
 
     	if (!(*pte & 0x00000001)) {   // 只要是创建页表,pte就应该不存在,多判断一下放心
-	 		*pte = (page_phyaddr | PG_US_U | PG_RW_W | PG_P_1);    // US=1,RW=1,P=1
+	 		*pte = (page_phyaddr | attr | PG_RW_W | PG_P_1);    // RW=1,P=1
       	} 
 		else {			    //应该不会执行到这，因为上面的ASSERT会先执行。
 	 		PANIC("pte repeat");
@@ -192,43 +462,101 @@ static void page_table_add(void* _vaddr, void* _page_phyaddr) {
      	}
    	} 
 	else {			    // 页目录项不存在,所以要先创建页目录再创建页表项.
-      /* 页表中用到的页框一律从内核空间分配 */
-      	uint32_t pde_phyaddr = (uint32_t)palloc(&kernel_pool);
+      /* 页表中用到的页框一律从内核空间分配,先从清零页框池中拿,拿到了就不必再清0 */
+      	lock_acquire(&kernel_pool.lock);
+      	uint32_t pde_phyaddr = (uint32_t)zeroed_palloc(&kernel_pool);
+      	bool zeroed = pde_phyaddr != 0;
+      	if (!zeroed) {
+      		pde_phyaddr = (uint32_t)palloc(&kernel_pool);
+      	}
+      	lock_release(&kernel_pool.lock);
+      	if (pde_phyaddr == 0) {
+      		ASSERT(vaddr < 0xc0000000);
+      		return false;
+      	}
 
       	*pde = (pde_phyaddr | PG_US_U | PG_RW_W | PG_P_1);
+      	if (vaddr < 0xc0000000) {    // 内核空间的页表各进程共享,从不回收,只给用户页表计数
+      		phy_to_page(pde_phyaddr)->pte_cnt = 1;
+      		page_table_cnt++;
+      	}
 
       	/* 分配到的物理页地址pde_phyaddr对应的物理内存清0,
        	* 避免里面的陈旧数据变成了页表项,从而让页表混乱.
        	* 访问到pde对应的物理地址,用pte取高20位便可.
        	* 因为pte是基于该pde对应的物理地址内再寻址,
        	* 把低12位置0便是该pde对应的物理页的起始*/
-      	memset((void*)((int)pte & 0xfffff000), 0, PG_SIZE);
+      	if (!zeroed) {
+      		memset((void*)((int)pte & 0xfffff000), 0, PG_SIZE);
+      	}
          
       	ASSERT(!(*pte & 0x00000001));
-      	*pte = (page_phyaddr | PG_US_U | PG_RW_W | PG_P_1);      // US=1,RW=1,P=1
+      	*pte = (page_phyaddr | attr | PG_RW_W | PG_P_1);      // RW=1,P=1
    	}
+   	return true;
+}
+
+/* 用户地址vaddr所在的虚拟页是否已经映射了物理页框,先看pde,pde不存在时不能去读pte */
+static bool page_mapped(uint32_t vaddr) {
+   	return (*pde_ptr(vaddr) & PG_P_1) && (*pte_ptr(vaddr) & PG_P_1);
 }
 
-/* 分配pg_cnt个页空间,成功则返回起始虚拟地址,失败时返回NULL */
+/* 分配pg_cnt个页空间,成功则返回起始虚拟地址,失败时返回NULL
+ * 用户内存只预留虚拟地址,物理页框等第一次访问时由page_fault_handler分配 */
 void* malloc_page(enum pool_flags pf, uint32_t pg_cnt) {
    	ASSERT(pg_cnt > 0 && pg_cnt < 3840);
 /***********   malloc_page的原理是三个动作的合成:   ***********
       1通过vaddr_get在虚拟内存池中申请虚拟地址
-      2通过palloc在物理内存池中申请物理页
+      2通过伙伴系统在物理内存池中申请物理上连续的页框
       3通过page_table_add将以上得到的虚拟地址和物理地址在页表中完成映射
 ***************************************************************/
    	void* vaddr_start = vaddr_get(pf, pg_cnt);
-   	if (vaddr_start == NULL) {
-      	return NULL;
+   	if (vaddr_start == NULL || pf == PF_USER) {
+      	return vaddr_start;
    	}
 
    	uint32_t vaddr = (uint32_t)vaddr_start, cnt = pg_cnt;
    	struct pool* mem_pool = pf & PF_KERNEL ? &kernel_pool : &user_pool;
 
-   	/* 因为虚拟地址是连续的,但物理地址可以是不连续的,所以逐个做映射*/
+   	/* 先按2的幂向上取整,一次从伙伴系统拿一整块连续页框,多出来的尾部马上还回去 */
+   	uint32_t order = 0;
+   	while ((1u << order) < pg_cnt) {
+   		order++;
+   	}
+   	int32_t pg_idx = -1;
+   	enum intr_status old_status = intr_disable();
+   	if (order <= MAX_ORDER && pool_charge(mem_pool, pg_cnt)) {
+   		pg_idx = buddy_alloc(&mem_zone, order);
+   		if (pg_idx == -1) {    // 够数但凑不出连续的块,下面逐页分配时再重新记账
+   			mem_pool->used_pages -= pg_cnt;
+   		} 
+   		else {
+   			buddy_free_range(&mem_zone, pg_idx + pg_cnt, (1 << order) - pg_cnt);
+   			uint32_t idx;
+   			for (idx = pg_idx; idx < pg_idx + pg_cnt; idx++) {
+   				frame_claim(mem_pool, idx);
+   			}
+   		}
+   	}
+   	intr_set_status(old_status);
+   	if (pg_idx != -1) {
+   		uint32_t page_phyaddr = mem_zone.phy_addr_start + pg_idx * PG_SIZE;
+   		while (cnt-- > 0) {
+   			page_table_add((void*)vaddr, (void*)page_phyaddr);
+   			vaddr += PG_SIZE;
+   			page_phyaddr += PG_SIZE;
+   		}
+   		return vaddr_start;
+   	}
+
+   	/* 碎片太多找不到足够大的连续块时,退回逐页分配,虚拟地址是连续的,物理地址可以是不连续的,所以逐个做映射*/
    	while (cnt-- > 0) {
       	void* page_phyaddr = palloc(mem_pool);
-      	if (page_phyaddr == NULL) {  // 失败时要将曾经已申请的虚拟地址和物理页全部回滚，在将来完成内存回收时再补充
+      	if (page_phyaddr == NULL) {  // 失败时把已经映射上的页框和整段虚拟地址都退回去
+      		if (vaddr != (uint32_t)vaddr_start) {
+      			page_unmap(pf, vaddr_start, (vaddr - (uint32_t)vaddr_start) / PG_SIZE);
+      		}
+      		vaddr_remove(pf, vaddr_start, pg_cnt);
 	 		return NULL;
 		}
     	page_table_add((void*)vaddr, page_phyaddr); // 在页表中做映射 
@@ -237,69 +565,153 @@ void* malloc_page(enum pool_flags pf, uint32_t pg_cnt) {
    	return vaddr_start;
 }
 
-/* 从内核物理内存池中申请pg_cnt页内存,成功则返回其虚拟地址,失败则返回NULL */
+/* 从内核物理内存池中申请pg_cnt页清0的内存,成功则返回其虚拟地址,失败则返回NULL
+ * 只要一页时先从清零页框池中拿,拿不到或要多页时在放开锁以后再清0,不拖长内核池的持锁时间 */
 void* get_kernel_pages(uint32_t pg_cnt) {
+	void* vaddr;
 	lock_acquire(&kernel_pool.lock);
-   	void* vaddr =  malloc_page(PF_KERNEL, pg_cnt);
-   	if (vaddr != NULL) {	   // 若分配的地址不为空,将页框清0后返回
+	void* page_phyaddr = pg_cnt == 1 ? zeroed_palloc(&kernel_pool) : NULL;
+	if (page_phyaddr != NULL) {
+		vaddr = vaddr_get(PF_KERNEL, 1);
+		if (vaddr != NULL) {
+			page_table_add(vaddr, page_phyaddr);
+		} 
+		else {
+			pfree((uint32_t)page_phyaddr);
+		}
+		lock_release(&kernel_pool.lock);
+		return vaddr;
+	}
+   	vaddr =  malloc_page(PF_KERNEL, pg_cnt);
+	lock_release(&kernel_pool.lock);
+   	if (vaddr != NULL) {	   // 这些页已经归自己了,不用持锁清0
       	memset(vaddr, 0, pg_cnt * PG_SIZE);
    	}
-	lock_release(&kernel_pool.lock);
    	return vaddr;
 }
 
-/* 在用户空间中申请4k内存,并返回其虚拟地址 */
+/* 从内核物理内存池中申请pg_cnt页内存但不清0,内容由调用者自己初始化,slab用它建slab,成功则返回其虚拟地址,失败则返回NULL */
+void* get_kernel_pages_raw(uint32_t pg_cnt) {
+	lock_acquire(&kernel_pool.lock);
+	void* vaddr = malloc_page(PF_KERNEL, pg_cnt);
+	lock_release(&kernel_pool.lock);
+	return vaddr;
+}
+
+/* 释放以vaddr起始的pg_cnt页内核内存 */
+void free_kernel_pages(void* vaddr, uint32_t pg_cnt) {
+	lock_acquire(&kernel_pool.lock);
+	mfree_page(PF_KERNEL, vaddr, pg_cnt);
+	lock_release(&kernel_pool.lock);
+}
+
+/* 在用户空间中申请4k内存,并返回其虚拟地址,缺页时分到的页框本来就是清0的,所以不必再memset */
 void* get_user_pages(uint32_t pg_cnt) {
    lock_acquire(&user_pool.lock);
    void* vaddr = malloc_page(PF_USER, pg_cnt);
-   memset(vaddr, 0, pg_cnt * PG_SIZE);
    lock_release(&user_pool.lock);
    return vaddr;
 }
 
+/* 给当前进程预留pg_cnt页连续的用户地址,供用户态malloc整块取用,页框在第一次访问时才分配.
+ * vaddr为NULL时由内核挑地址,否则只在以vaddr起始的这段地址空闲时占下它,realloc原地扩展大块时用.
+ * 成功返回页对齐的起始地址,失败返回NULL */
+void* sys_mmap(void* vaddr, uint32_t pg_cnt) {
+	if (pg_cnt == 0 || pg_cnt >= 3840) {     // malloc_page一次能给的上限
+		return NULL;
+	}
+	if (vaddr == NULL) {
+		return get_user_pages(pg_cnt);
+	}
+	if ((uint32_t)vaddr % PG_SIZE != 0) {
+		return NULL;
+	}
+	lock_acquire(&user_pool.lock);
+	struct task_struct* cur = running_thread();
+	bool ok = vma_try_insert(&cur->userprog_vmas, (uint32_t)vaddr, (uint32_t)vaddr + pg_cnt * PG_SIZE, VM_READ | VM_WRITE);
+	lock_release(&user_pool.lock);
+	return ok ? vaddr : NULL;
+}
+
+/* 把sys_mmap得到的以vaddr起始的pg_cnt页还给内核,范围不在可分配的用户地址内时返回-1,成功返回0 */
+int32_t sys_munmap(void* vaddr, uint32_t pg_cnt) {
+	uint32_t start = (uint32_t)vaddr;
+	if (start % PG_SIZE != 0 || pg_cnt == 0 || start < USER_VADDR_START || start >= USER_HEAP_VADDR || \
+		pg_cnt > (USER_HEAP_VADDR - start) / PG_SIZE) {
+		return -1;
+	}
+	lock_acquire(&user_pool.lock);
+	mfree_page(PF_USER, vaddr, pg_cnt);
+	lock_release(&user_pool.lock);
+	return 0;
+}
+
 //用于为指定的虚拟地址申请一个物理页，传入参数是这个虚拟地址，要申请的物理页所在的地址池的标志。申请失败，返回null
 void* get_a_page(enum pool_flags pf, uint32_t vaddr) {
 	struct pool* mem_pool = pf & PF_KERNEL ? &kernel_pool : &user_pool;
 	lock_acquire(&mem_pool->lock);
 	struct task_struct* cur = running_thread();
-	int32_t bit_idx = -1;
-	/* 若当前是用户进程申请用户内存,就修改用户进程自己的虚拟地址位图 */
+	/* 若当前是用户进程申请用户内存,就把这一页登记到用户进程自己的区域树中 */
 	if (cur->pgdir != NULL && pf == PF_USER) {
-		bit_idx = (vaddr - cur->userprog_vaddr.vaddr_start) / PG_SIZE;
-		ASSERT(bit_idx > 0);
-		bitmap_set(&cur->userprog_vaddr.vaddr_bitmap, bit_idx, 1);
+		ASSERT(vaddr >= USER_VADDR_START && vaddr < 0xc0000000);
+		if (vma_find(&cur->userprog_vmas, vaddr) == NULL && \
+			!vma_insert(&cur->userprog_vmas, vaddr, vaddr + PG_SIZE, VM_READ | VM_WRITE)) {
+			lock_release(&mem_pool->lock);
+			return NULL;
+		}
 	} 
 	else if (cur->pgdir == NULL && pf == PF_KERNEL){
-	/* 如果是内核线程申请内核内存,就修改kernel_vaddr. */
-		bit_idx = (vaddr - kernel_vaddr.vaddr_start) / PG_SIZE;
-		ASSERT(bit_idx > 0);
-		bitmap_set(&kernel_vaddr.vaddr_bitmap, bit_idx, 1);
+	/* 如果是内核线程申请内核内存,就在kernel_vmem中占下这一页 */
+		ASSERT(vaddr > K_HEAP_START);
+		if (vmem_xalloc(&kernel_vmem, vaddr, PG_SIZE) == 0) {
+			lock_release(&mem_pool->lock);
+			return NULL;
+		}
 	} 
 	else {
 		PANIC("get_a_page:not allow kernel alloc userspace or user alloc kernelspace by get_a_page");
 	}
 	void* page_phyaddr = palloc(mem_pool);
-	if (page_phyaddr == NULL)
+	if (page_phyaddr == NULL) {
+		lock_release(&mem_pool->lock);
 		return NULL;
-	page_table_add((void*)vaddr, page_phyaddr); 
+	}
+	if (!page_table_add((void*)vaddr, page_phyaddr)) {
+		pfree((uint32_t)page_phyaddr);
+		lock_release(&mem_pool->lock);
+		return NULL;
+	}
 	lock_release(&mem_pool->lock);
 	return (void*)vaddr;
 }
 
 //初始化管理不同种类型arena的不同mem_block_desc
 void block_desc_init(struct mem_block_desc* desc_array) {				   
-   	uint16_t desc_idx, block_size = 16;
+   	uint16_t desc_idx;
    	for (desc_idx = 0; desc_idx < DESC_CNT; desc_idx++) {
-      	desc_array[desc_idx].block_size = block_size;
-      	desc_array[desc_idx].blocks_per_arena = (PG_SIZE - sizeof(struct arena)) / block_size;	  
+      	desc_array[desc_idx].block_size = block_sizes[desc_idx];
+      	desc_array[desc_idx].blocks_per_arena = (PG_SIZE - sizeof(struct arena)) / block_sizes[desc_idx];	  
       	list_init(&desc_array[desc_idx].free_list);
-      	block_size *= 2;         // 更新为下一个规格内存块
+      	desc_array[desc_idx].alloc_cnt = 0;
+      	desc_array[desc_idx].req_bytes = 0;
+      	desc_array[desc_idx].lock_cnt = 0;
    }
 }
 
+/* 生成size_to_desc映射表 */
+static void size_class_init(void) {
+   	uint32_t slot, desc_idx = 0;
+   	for (slot = 0; slot <= MAX_BLOCK_SIZE / 16; slot++) {
+      	while (block_sizes[desc_idx] < slot * 16) {
+         	desc_idx++;
+      	}
+      	size_to_desc[slot] = desc_idx;
+   	}
+}
+
 /* 返回arena中第idx个内存块的地址 */
 static struct mem_block* arena2block(struct arena* a, uint32_t idx) {
-	return (struct mem_block*)((uint32_t)a + sizeof(struct arena) + idx * a->desc->block_size);
+	return (struct mem_block*)((uint32_t)a + sizeof(struct arena) + idx * block_sizes[a->desc_idx]);
 }
 
 /* 返回内存块b所在的arena地址 */
@@ -307,248 +719,781 @@ static struct arena* block2arena(struct mem_block* b) {
    	return (struct arena*)((uint32_t)b & 0xfffff000);
 }
 
+/* 从内存块描述符descs[desc_idx]中取出一个空闲内存块,调用者需持有内存池的锁,失败返回NULL
+ * arena不再在创建时整个拆进链表,而是先从arena内的空闲单链表取块,没有再用bump指针切出一块,创建和取块都是O(1) */
+static struct mem_block* desc_block_get(enum pool_flags PF, struct mem_block_desc* descs, uint32_t desc_idx) {
+	struct mem_block_desc* desc = &descs[desc_idx];
+	struct arena* a;
+	struct mem_block* b;
+
+	/* 若mem_block_desc的free_list中已经没有有空闲块的arena,就创建新的arena */
+	if (list_empty(&desc->free_list)) {
+		PERF_BEGIN(t);
+		a = malloc_page(PF, 1);       // 分配1页框做为arena
+		if (a == NULL) {
+			return NULL;
+		}
+
+		/* 对于分配的小块内存,将desc置为相应内存块描述符, 
+		* cnt置为此arena可用的内存块数,块在用到时才切出,所以不用清整页 */
+		a->desc_idx = desc_idx;
+		a->cnt = desc->blocks_per_arena;
+		a->carved = 0;
+		a->free_head = NULL;
+		list_append(&desc->free_list, &a->arena_elem);
+		PERF_END(PERF_ARENA_NEW, t);
+	}    
+
+	/* 开始分配内存块,优先复用释放过的块 */
+	a = elem2entry(struct arena, arena_elem, desc->free_list.head.next);
+	if (a->free_head != NULL) {
+		b = a->free_head;
+		a->free_head = b->next;
+	} 
+	else {
+		b = arena2block(a, a->carved++);
+	}
+	if (--a->cnt == 0) {       // 将此arena中的空闲内存块数减1,分完了就不再留在free_list上
+		list_remove(&a->arena_elem);
+	}
+	return b;
+}
+
+/* 把小内存块b还回所在arena,arena中的块全部空闲时释放arena,调用者需持有内存池的锁 */
+static void desc_block_put(enum pool_flags PF, struct mem_block_desc* descs, struct mem_block* b) {
+	struct arena* a = block2arena(b);
+	struct mem_block_desc* desc = &descs[a->desc_idx];
+	b->next = a->free_head;
+	a->free_head = b;
+	if (a->cnt++ == 0) {       // arena原来是满的,现在有空闲块了,重新挂回free_list
+		list_append(&desc->free_list, &a->arena_elem);
+	}
+
+	/* 再判断此arena中的内存块是否都是空闲,如果是就释放arena */
+	if (a->cnt == desc->blocks_per_arena) {
+		PERF_BEGIN(t);
+		list_remove(&a->arena_elem);
+		mfree_page(PF, a, 1); 
+		PERF_END(PERF_ARENA_RETIRE, t);
+	} 
+}
+
+/* 虚拟地址vaddr所在的桶,连续分配的大块起始页号相邻,取低位就能散开 */
+static struct large_desc** large_bucket(struct large_table* table, uint32_t vaddr) {
+	return &table->buckets[(vaddr / PG_SIZE) % LARGE_HASH_SIZE];
+}
+
+/* 把大块描述符ld加入散列表,调用者需持有内存池的锁 */
+static void large_insert(struct large_table* table, struct large_desc* ld) {
+	struct large_desc** bucket = large_bucket(table, ld->vaddr);
+	ld->next = *bucket;
+	*bucket = ld;
+	table->cnt++;
+	table->pages += ld->pg_cnt;
+}
+
+/* 返回散列表中指向起始地址为vaddr的大块描述符的那个指针,没有这个大块时它指向NULL,调用者需持有内存池的锁 */
+static struct large_desc** large_link(struct large_table* table, uint32_t vaddr) {
+	struct large_desc** link = large_bucket(table, vaddr);
+	while (*link != NULL && (*link)->vaddr != vaddr) {
+		link = &(*link)->next;
+	}
+	return link;
+}
+
+/* 从散列表中摘下起始地址为vaddr的大块描述符并返回,没有则返回NULL,调用者需持有内存池的锁 */
+static struct large_desc* large_remove(struct large_table* table, uint32_t vaddr) {
+	struct large_desc** link = large_link(table, vaddr);
+	struct large_desc* ld = *link;
+	if (ld != NULL) {
+		*link = ld->next;
+		table->cnt--;
+		table->pages -= ld->pg_cnt;
+	}
+	return ld;
+}
+
+/* fork时把src中的大块描述符复制给dst,子进程继承了父进程的大块,也要能释放它们.
+ * 描述符申请失败时dst为空表并返回false */
+bool large_table_copy(struct large_table* dst, struct large_table* src) {
+	uint32_t bucket_idx;
+	memset(dst, 0, sizeof(*dst));
+	for (bucket_idx = 0; bucket_idx < LARGE_HASH_SIZE; bucket_idx++) {
+		struct large_desc* ld = src->buckets[bucket_idx];
+		while (ld != NULL) {
+			struct large_desc* copy = kmem_cache_alloc(large_cache);
+			if (copy == NULL) {
+				large_table_destroy(dst);
+				return false;
+			}
+			copy->vaddr = ld->vaddr;
+			copy->pg_cnt = ld->pg_cnt;
+			large_insert(dst, copy);
+			ld = ld->next;
+		}
+	}
+	return true;
+}
+
+/* 释放散列表中所有的大块描述符,大块本身的页由调用者另行处理,进程退出时用 */
+void large_table_destroy(struct large_table* table) {
+	uint32_t bucket_idx;
+	for (bucket_idx = 0; bucket_idx < LARGE_HASH_SIZE; bucket_idx++) {
+		while (table->buckets[bucket_idx] != NULL) {
+			struct large_desc* ld = table->buckets[bucket_idx];
+			table->buckets[bucket_idx] = ld->next;
+			kmem_cache_free(large_cache, ld);
+		}
+	}
+	table->cnt = table->pages = 0;
+}
+
 /* 在堆中申请size字节内存 */
 void* sys_malloc(uint32_t size) {
 	enum pool_flags PF;
 	struct pool* mem_pool;
-	uint32_t pool_size;
 	struct mem_block_desc* descs;	//用于存储mem_block_desc数组地址
 	struct task_struct* cur_thread = running_thread();
 
 	/* 判断用哪个内存池*/
 	if (cur_thread->pgdir == NULL) {     // 若为内核线程
 		PF = PF_KERNEL; 
-		pool_size = kernel_pool.pool_size;
 		mem_pool = &kernel_pool;
 		descs = k_block_descs;
 	} 
 	else {				      // 用户进程pcb中的pgdir会在为其分配页表时创建
 		PF = PF_USER;
-		pool_size = user_pool.pool_size;
 		mem_pool = &user_pool;
 		descs = cur_thread->u_block_desc;
 	}
 
-	/* 若申请的内存不在内存池容量范围内则直接返回NULL */
-	if (!(size > 0 && size < pool_size)) {
+	/* 若申请的内存超过了这个内存池的上限则直接返回NULL */
+	if (!(size > 0 && size < mem_pool->max_pages * PG_SIZE)) {
 		return NULL;
 	}
 	struct arena* a;
 	struct mem_block* b;	
-	lock_acquire(&mem_pool->lock);
 
 	/* 超过最大内存块1024, 就分配页框 */
-	if (size > 1024) {
-		uint32_t page_cnt = DIV_ROUND_UP(size + sizeof(struct arena), PG_SIZE);    // 向上取整需要的页框数
-		a = malloc_page(PF, page_cnt);
-		if (a != NULL) {
-			memset(a, 0, page_cnt * PG_SIZE);	 // 将分配的内存清0  
-
-			/* 对于分配的大块页框,将desc置为NULL, cnt置为页框数,large置为true */
-			a->desc = NULL;
-			a->cnt = page_cnt;
-			a->large = true;
-			lock_release(&mem_pool->lock);
-			return (void*)(a + 1);		 // 跨过arena大小，把剩下的内存返回
+	if (size > MAX_BLOCK_SIZE) {
+		PERF_BEGIN(t);
+		uint32_t page_cnt = DIV_ROUND_UP(size, PG_SIZE);    // 元信息不占页内空间,整页倍数的申请正好用这么多页
+		struct large_desc* ld = kmem_cache_alloc(large_cache);
+		if (ld == NULL) {
+			return NULL;
+		}
+		if (PF == PF_KERNEL) {	 // 内核的页要清0,交给get_kernel_pages在锁外清0;用户页在缺页时才分配且已经清0
+			a = get_kernel_pages(page_cnt);
+			lock_acquire(&mem_pool->lock);
 		} 
-		else { 
-			lock_release(&mem_pool->lock);
-			return NULL; 
+		else {
+			lock_acquire(&mem_pool->lock);
+			a = malloc_page(PF, page_cnt);
 		}
+		if (a != NULL) {
+			ld->vaddr = (uint32_t)a;
+			ld->pg_cnt = page_cnt;
+			large_insert(PF == PF_KERNEL ? &k_large : &cur_thread->u_large, ld);
+		}
+		lock_release(&mem_pool->lock);
+		if (a == NULL) {
+			kmem_cache_free(large_cache, ld);
+		}
+		PERF_END(PERF_MALLOC_LARGE, t);
+		return (void*)a;		 // 页对齐的地址,sys_free据此认出是大块
 	} 
 	else {    // 若申请的内存小于等于1024,可在各种规格的mem_block_desc中去适配
-		uint8_t desc_idx;
-		
-		/* 从内存块描述符中匹配合适的内存块规格 */
-		for (desc_idx = 0; desc_idx < DESC_CNT; desc_idx++) {
-			if (size <= descs[desc_idx].block_size) {  // 从小往大后,找到后退出
-				break;
+		PERF_BEGIN(t);
+		/* 查表得到能容纳size的最小规格 */
+		uint8_t desc_idx = size_to_desc[DIV_ROUND_UP(size, 16)];
+		ASSERT(size <= descs[desc_idx].block_size);
+
+	/* 弹匣空了才持锁,一次从mem_block_desc中取出MAG_BATCH个块装进弹匣 */
+		struct mem_magazine* mag = &cur_thread->mags[desc_idx];
+		if (mag->rounds == 0) {
+			lock_acquire(&mem_pool->lock);
+			descs[desc_idx].lock_cnt++;
+			while (mag->rounds < MAG_BATCH) {
+				b = desc_block_get(PF, descs, desc_idx);
+				if (b == NULL) {
+					break;
+				}
+				mag->blocks[mag->rounds++] = b;
 			}
-		}
-
-	/* 若mem_block_desc的free_list中已经没有可用的mem_block,
-		* 就创建新的arena提供mem_block */
-		if (list_empty(&descs[desc_idx].free_list)) {
-			a = malloc_page(PF, 1);       // 分配1页框做为arena
-			if (a == NULL) {
-				lock_release(&mem_pool->lock);
+			lock_release(&mem_pool->lock);
+			if (mag->rounds == 0) {
 				return NULL;
 			}
-			memset(a, 0, PG_SIZE);
-
-			/* 对于分配的小块内存,将desc置为相应内存块描述符, 
-			* cnt置为此arena可用的内存块数,large置为false */
-			a->desc = &descs[desc_idx];
-			a->large = false;
-			a->cnt = descs[desc_idx].blocks_per_arena;
-			uint32_t block_idx;
-
-			enum intr_status old_status = intr_disable();
-
-			/* 开始将arena拆分成内存块,并添加到内存块描述符的free_list中 */
-			for (block_idx = 0; block_idx < descs[desc_idx].blocks_per_arena; block_idx++) {
-				b = arena2block(a, block_idx);
-				ASSERT(!elem_find(&a->desc->free_list, &b->free_elem));
-				list_append(&a->desc->free_list, &b->free_elem);	
-			}
-			intr_set_status(old_status);
-		}    
+		}
 
 	/* 开始分配内存块 */
-		b = elem2entry(struct mem_block, free_elem, list_pop(&(descs[desc_idx].free_list)));
+		b = mag->blocks[--mag->rounds];
 		memset(b, 0, descs[desc_idx].block_size);
-
-		a = block2arena(b);  // 获取内存块b所在的arena
-		a->cnt--;		   // 将此arena中的空闲内存块数减1
-		lock_release(&mem_pool->lock);
+		descs[desc_idx].alloc_cnt++;       // 统计不持锁,多个内核线程并发时只是个近似值
+		descs[desc_idx].req_bytes += size;
+		PERF_END(PERF_MALLOC_SMALL, t);
 		return (void*)b;
 	}
 }
 
-//将物理地址pg_phy_addr回收到物理内存池，实质就是清除物理内存池中位图的位
+//将物理地址pg_phy_addr回收到物理内存池，实质就是从所属使用者的账上减掉,把这一页还给伙伴系统，并尽量与伙伴合并成大块
 void pfree(uint32_t pg_phy_addr) {
-	struct pool* mem_pool;
-	uint32_t bit_idx = 0;
-	if (pg_phy_addr >= user_pool.phy_addr_start) {     // 用户物理内存池
-		mem_pool = &user_pool;
-		bit_idx = (pg_phy_addr - user_pool.phy_addr_start) / PG_SIZE;
+	PERF_BEGIN(t);
+	struct page* pg = phy_to_page(pg_phy_addr);
+	enum intr_status old_status = intr_disable();
+	if (pg->ref_cnt > 1) {	   // 还有别的进程通过写时复制共享此页框,只减引用计数
+		pg->ref_cnt--;
 	} 
-	else {	  // 内核物理内存池
-		mem_pool = &kernel_pool;
-		bit_idx = (pg_phy_addr - kernel_pool.phy_addr_start) / PG_SIZE;
+	else {
+		struct pool* mem_pool = pg->flags & PAGE_USER ? &user_pool : &kernel_pool;
+		mem_pool->used_pages--;
+		pg->ref_cnt = 0;
+		buddy_free(&mem_zone, pg - mem_zone.pages, 0);
 	}
-	bitmap_set(&mem_pool->pool_bitmap, bit_idx, 0);	 // 将位图中该位清0
+	intr_set_status(old_status);
+	PERF_END(PERF_PFREE, t);
 }
 
-/* 去掉页表中虚拟地址vaddr的映射,只去掉vaddr对应的pte */
-static void page_table_pte_remove(uint32_t vaddr) {
-   uint32_t* pte = pte_ptr(vaddr);
-   *pte &= ~PG_P_1;	// 将页表项pte的P位置0
-   asm volatile ("invlpg %0"::"m" (vaddr):"memory");    //更新tlb
+/* 回收用户地址vaddr起pg_cnt页所跨的页表中已经没有页表项的,连同页目录项一起清掉 */
+static void page_table_reclaim(uint32_t vaddr, uint32_t pg_cnt) {
+	uint32_t pde_idx = PDE_IDX(vaddr);
+	uint32_t pde_idx_end = PDE_IDX(vaddr + (pg_cnt - 1) * PG_SIZE);
+	lock_acquire(&kernel_pool.lock);	   // 页表页框属于内核内存池
+	for (; pde_idx <= pde_idx_end; pde_idx++) {
+		uint32_t* pde = pde_ptr(pde_idx << 22);
+		if (!(*pde & PG_P_1) || phy_to_page(*pde & 0xfffff000)->pte_cnt != 0) {
+			continue;
+		}
+		pfree(*pde & 0xfffff000);
+		*pde = 0;
+		/* 页表本身经由页目录最后一项的自映射映射在pte_ptr处,这个tlb表项也得冲掉,
+		 * 否则以后在这里新建页表时,清0和填表会写到已经还回内存池的旧页框上 */
+		invlpg((uint32_t)pte_ptr(pde_idx << 22));
+		page_table_cnt--;
+	}
+	lock_release(&kernel_pool.lock);
 }
 
-//在虚拟地址池中释放以_vaddr起始的连续pg_cnt个虚拟页地址，实质就是清楚虚拟内存池位图的位
+/* 进程退出时释放其用户空间的全部页框和页表,不必逐个区域去找,直接扫页目录的用户部分.
+ * 完了页目录的用户部分全是0,正是页目录刚构造好的样子.调用者随后换下这个页目录,tlb中的旧表项随之作废 */
+void user_pgdir_free(void) {
+	uint32_t pde_idx;
+	lock_acquire(&user_pool.lock);
+	lock_acquire(&kernel_pool.lock);	   // 页表页框属于内核内存池
+	for (pde_idx = 0; pde_idx < 768; pde_idx++) {
+		uint32_t* pde = pde_ptr(pde_idx << 22);
+		if (!(*pde & PG_P_1)) {
+			continue;
+		}
+		uint32_t* pte = pte_ptr(pde_idx << 22);
+		uint32_t pte_idx;
+		for (pte_idx = 0; pte_idx < 1024; pte_idx++) {
+			if (pte[pte_idx] & PG_P_1) {
+				pfree(pte[pte_idx] & 0xfffff000);	// 写时复制共享的页框只减引用计数
+			}
+		}
+		pfree(*pde & 0xfffff000);
+		*pde = 0;
+		invlpg((uint32_t)pte);
+		page_table_cnt--;
+	}
+	lock_release(&kernel_pool.lock);
+	lock_release(&user_pool.lock);
+}
+
+/* 内核线程退出时把弹匣中缓存的内存块还回k_block_descs,否则这些块就永远不能再分配了 */
+void block_mags_drain(void) {
+	struct task_struct* cur_thread = running_thread();
+	ASSERT(cur_thread->pgdir == NULL);
+	uint32_t desc_idx;
+	lock_acquire(&kernel_pool.lock);
+	for (desc_idx = 0; desc_idx < DESC_CNT; desc_idx++) {
+		struct mem_magazine* mag = &cur_thread->mags[desc_idx];
+		while (mag->rounds > 0) {
+			desc_block_put(PF_KERNEL, k_block_descs, mag->blocks[--mag->rounds]);
+		}
+	}
+	lock_release(&kernel_pool.lock);
+}
+
+//在虚拟地址池中释放以_vaddr起始的连续pg_cnt个虚拟页地址，内核的还给kernel_vmem,必须是当初整段分配的,用户的从进程的区域树中去掉
 static void vaddr_remove(enum pool_flags pf, void* _vaddr, uint32_t pg_cnt) {
-	uint32_t bit_idx_start = 0, vaddr = (uint32_t)_vaddr, cnt = 0;
+	uint32_t vaddr = (uint32_t)_vaddr;
 	if (pf == PF_KERNEL) {  // 内核虚拟内存池
-		bit_idx_start = (vaddr - kernel_vaddr.vaddr_start) / PG_SIZE;
-		while(cnt < pg_cnt) {
-			bitmap_set(&kernel_vaddr.vaddr_bitmap, bit_idx_start + cnt++, 0);
-		}
+		PERF_BEGIN(t);
+		vmem_free(&kernel_vmem, vaddr, pg_cnt * PG_SIZE);
+		PERF_END(PERF_VMEM_FREE, t);
 	} 
 	else {  // 用户虚拟内存池
+		/* 要从区域中间挖掉一段而申请不到结点时,这段地址只好继续占着,不影响正确性 */
 		struct task_struct* cur_thread = running_thread();
-		bit_idx_start = (vaddr - cur_thread->userprog_vaddr.vaddr_start) / PG_SIZE;
-		while(cnt < pg_cnt) {
-			bitmap_set(&cur_thread->userprog_vaddr.vaddr_bitmap, bit_idx_start + cnt++, 0);
-		}
+		vma_remove(&cur_thread->userprog_vmas, vaddr, vaddr + pg_cnt * PG_SIZE);
 	}
 }
 
-/* 释放以虚拟地址vaddr为起始的cnt个物理页框 */
-void mfree_page(enum pool_flags pf, void* _vaddr, uint32_t pg_cnt) {
-	uint32_t pg_phy_addr;
-	uint32_t vaddr = (int32_t)_vaddr, page_cnt = 0;
+/* 撤销以虚拟地址vaddr为起始的pg_cnt页的映射并释放其物理页框,用户内存中从没访问过的页没有页框,跳过即可
+ * 先逐页把页框还回内存池并清掉pte,再对整段地址统一处理tlb,虚拟地址不归还 */
+static void page_unmap(enum pool_flags pf, void* _vaddr, uint32_t pg_cnt) {
+	uint32_t vaddr = (int32_t)_vaddr, page_cnt;
 	ASSERT(pg_cnt >=1 && vaddr % PG_SIZE == 0); 
-	pg_phy_addr = addr_v2p(vaddr);  // 获取虚拟地址vaddr对应的物理地址
-
-	/* 确保待释放的物理内存在低端1M+1k大小的页目录+1k大小的页表地址范围外 */
-	ASSERT((pg_phy_addr % PG_SIZE) == 0 && pg_phy_addr >= 0x102000);
-	
-	/* 判断pg_phy_addr属于用户物理内存池还是内核物理内存池 */
-	if (pg_phy_addr >= user_pool.phy_addr_start) {   // 位于user_pool内存池
-		vaddr -= PG_SIZE;
-		while (page_cnt < pg_cnt) {
-			vaddr += PG_SIZE;
-			pg_phy_addr = addr_v2p(vaddr);
-
-			/* 确保物理地址属于用户物理内存池 */
-			ASSERT((pg_phy_addr % PG_SIZE) == 0 && pg_phy_addr >= user_pool.phy_addr_start);
-
-			/* 先将对应的物理页框归还到内存池 */
-			pfree(pg_phy_addr);
 
-				/* 再从页表中清除此虚拟地址所在的页表项pte */
-			page_table_pte_remove(vaddr);
-
-			page_cnt++;
+	for (page_cnt = 0; page_cnt < pg_cnt; page_cnt++, vaddr += PG_SIZE) {
+		if (pf == PF_USER && !page_mapped(vaddr)) {
+			continue;
 		}
-	/* 清空虚拟地址的位图中的相应位 */
-		vaddr_remove(pf, _vaddr, pg_cnt);
-
-	} 
-	else {	     // 位于kernel_pool内存池
-		vaddr -= PG_SIZE;	      
-		while (page_cnt < pg_cnt) {
-			vaddr += PG_SIZE;
-			pg_phy_addr = addr_v2p(vaddr);
-			/* 确保待释放的物理内存只属于内核物理内存池 */
-			ASSERT((pg_phy_addr % PG_SIZE) == 0 && \
-				pg_phy_addr >= kernel_pool.phy_addr_start && \
-				pg_phy_addr < user_pool.phy_addr_start);
-			
-			/* 先将对应的物理页框归还到内存池 */
-			pfree(pg_phy_addr);
-
-				/* 再从页表中清除此虚拟地址所在的页表项pte */
-			page_table_pte_remove(vaddr);
-
-			page_cnt++;
+		uint32_t* pte = pte_ptr(vaddr);
+		uint32_t pg_phy_addr = *pte & 0xfffff000;   // 直接从pte取物理地址,不必再走一遍addr_v2p
+
+		/* 确保物理地址属于可分配的页框,且记在对应内存池的账上 */
+		ASSERT(pg_phy_addr >= mem_zone.phy_addr_start && \
+			pg_phy_addr < mem_zone.phy_addr_start + mem_zone.page_cnt * PG_SIZE && \
+			!(phy_to_page(pg_phy_addr)->flags & PAGE_USER) == (pf == PF_KERNEL));
+
+		/* 先将对应的物理页框归还到内存池,再将页表项pte的P位置0 */
+		pfree(pg_phy_addr);
+		*pte &= ~PG_P_1;
+		if (pf == PF_USER) {
+			phy_to_page(*pde_ptr(vaddr) & 0xfffff000)->pte_cnt--;
 		}
-	/* 清空虚拟地址的位图中的相应位 */
-		vaddr_remove(pf, _vaddr, pg_cnt);
+	}
+	tlb_flush_range((uint32_t)_vaddr, pg_cnt);
+
+	/* 表项都清空了的页表要等tlb刷新过后再回收,免得页框被别人用了tlb里还留着经由它的旧映射 */
+	if (pf == PF_USER) {
+		page_table_reclaim((uint32_t)_vaddr, pg_cnt);
 	}
 }
 
+/* 释放以虚拟地址vaddr为起始的pg_cnt个物理页框并归还虚拟地址 */
+void mfree_page(enum pool_flags pf, void* _vaddr, uint32_t pg_cnt) {
+	PERF_BEGIN(t);
+	page_unmap(pf, _vaddr, pg_cnt);
+	vaddr_remove(pf, _vaddr, pg_cnt);
+	PERF_END(PERF_UNMAP, t);
+}
+
 /* 回收内存ptr */
 void sys_free(void* ptr) {
 	ASSERT(ptr != NULL);
 	if (ptr != NULL) {
 		enum pool_flags PF;
 		struct pool* mem_pool;
+		struct mem_block_desc* descs;
+		struct task_struct* cur_thread = running_thread();
 
 	/* 判断是线程还是进程 */
-		if (running_thread()->pgdir == NULL) {
+		if (cur_thread->pgdir == NULL) {
 			ASSERT((uint32_t)ptr >= K_HEAP_START);
 			PF = PF_KERNEL; 
 			mem_pool = &kernel_pool;
+			descs = k_block_descs;
 		} 
 		else {
 			PF = PF_USER;
 			mem_pool = &user_pool;
+			descs = cur_thread->u_block_desc;
 		}
 
-		lock_acquire(&mem_pool->lock);   
 		struct mem_block* b = ptr;
 		struct arena* a = block2arena(b);	     // 把mem_block转换成arena,获取元信息
-		ASSERT(a->large == 0 || a->large == 1);
-		if (a->desc == NULL && a->large == true) { // 大于1024的内存
-			mfree_page(PF, a, a->cnt); 
+		/* 小内存块前面总有arena头,不会页对齐,页对齐的只能是大于1024的大块 */
+		if ((uint32_t)ptr % PG_SIZE == 0) {
+			PERF_BEGIN(t);
+			lock_acquire(&mem_pool->lock);   
+			struct large_desc* ld = large_remove(PF == PF_KERNEL ? &k_large : &cur_thread->u_large, (uint32_t)ptr);
+			ASSERT(ld != NULL);
+			mfree_page(PF, ptr, ld->pg_cnt); 
+			lock_release(&mem_pool->lock); 
+			kmem_cache_free(large_cache, ld);
+			PERF_END(PERF_FREE_LARGE, t);
 		} 
-		else {				 // 小于等于1024的内存块先将内存块回收到free_list
-			list_append(&a->desc->free_list, &b->free_elem);
-
-			/* 再判断此arena中的内存块是否都是空闲,如果是就释放arena */
-			if (++a->cnt == a->desc->blocks_per_arena) {
-				uint32_t block_idx;
-				for (block_idx = 0; block_idx < a->desc->blocks_per_arena; block_idx++) {
-					struct mem_block*  b = arena2block(a, block_idx);
-					ASSERT(elem_find(&a->desc->free_list, &b->free_elem));
-					list_remove(&b->free_elem);
+		else {				 // 小于等于1024的内存块先放回本线程的弹匣
+			PERF_BEGIN(t);
+			uint32_t desc_idx = a->desc_idx;
+			ASSERT(desc_idx < DESC_CNT);
+			struct mem_magazine* mag = &cur_thread->mags[desc_idx];
+
+			/* 弹匣满了才持锁,一次把MAG_BATCH个块还回arena */
+			if (mag->rounds == MAG_ROUNDS) {
+				lock_acquire(&mem_pool->lock);   
+				descs[desc_idx].lock_cnt++;
+				while (mag->rounds > MAG_ROUNDS - MAG_BATCH) {
+					desc_block_put(PF, descs, mag->blocks[--mag->rounds]);
 				}
-				mfree_page(PF, a, 1); 
-			} 
+				lock_release(&mem_pool->lock); 
+			}
+			mag->blocks[mag->rounds++] = b;
+			PERF_END(PERF_FREE_SMALL, t);
 		}   
-		lock_release(&mem_pool->lock); 
 	}
 }
 
+/* 给大块ld原地扩展到new_pg页,紧接着的虚拟地址被占用或页框不够时什么也不改并返回false,调用者需持有内存池的锁.
+ * 内核的新页先一次记账并取齐页框,用struct page的free_elem串在frames上,占到地址后再逐页映射,
+ * 占不到地址时把页框还回去即可,不用再退还已经占下的地址;用户的等第一次访问时再分配 */
+static bool large_extend(enum pool_flags pf, struct large_table* table, struct large_desc* ld, uint32_t new_pg) {
+	uint32_t add = new_pg - ld->pg_cnt, done;
+	uint32_t vaddr = ld->vaddr + ld->pg_cnt * PG_SIZE;
+	struct list frames;
+	list_init(&frames);
+	if (pf == PF_KERNEL) {
+		enum intr_status old_status = intr_disable();
+		bool charged = pool_charge(&kernel_pool, add);
+		for (done = 0; charged && done < add; done++) {
+			list_append(&frames, &phy_to_page((uint32_t)frame_take(&kernel_pool))->free_elem);
+		}
+		intr_set_status(old_status);
+		if (!charged) {
+			return false;
+		}
+	}
+	bool grown = vaddr_grow(pf, ld->vaddr, ld->pg_cnt, add);
+	for (done = 0; !list_empty(&frames); done++) {
+		struct page* pg = elem2entry(struct page, free_elem, list_pop(&frames));
+		uint32_t page_phyaddr = mem_zone.phy_addr_start + (pg - mem_zone.pages) * PG_SIZE;
+		if (grown) {
+			page_table_add((void*)(vaddr + done * PG_SIZE), (void*)page_phyaddr);
+		} 
+		else {
+			pfree(page_phyaddr);
+		}
+	}
+	if (!grown) {
+		return false;
+	}
+	table->pages += add;
+	ld->pg_cnt = new_pg;
+	return true;
+}
+
+/* 把ptr指向的内存调整为size字节,返回调整后的地址,内容保留新旧大小中较小的那部分,失败时返回NULL且ptr不变.
+ * 小内存块在原规格还放得下时原地不动;大块缩小时归还尾部的页,扩大时先试着占下紧接着的虚拟页原地扩展,
+ * 都不行才另行分配并复制 */
+static void* realloc_block(void* ptr, uint32_t size) {
+	if (ptr == NULL) {
+		return sys_malloc(size);
+	}
+	if (size == 0) {
+		sys_free(ptr);
+		return NULL;
+	}
+	struct task_struct* cur_thread = running_thread();
+	enum pool_flags PF = cur_thread->pgdir == NULL ? PF_KERNEL : PF_USER;
+	struct pool* mem_pool = PF == PF_KERNEL ? &kernel_pool : &user_pool;
+	uint32_t old_size;
+
+	if ((uint32_t)ptr % PG_SIZE != 0) {    // 小内存块
+		struct arena* a = block2arena(ptr);
+		struct mem_block_desc* descs = PF == PF_KERNEL ? k_block_descs : cur_thread->u_block_desc;
+		old_size = descs[a->desc_idx].block_size;
+		if (size <= old_size) {
+			return ptr;
+		}
+	} 
+	else {
+		struct large_table* table = PF == PF_KERNEL ? &k_large : &cur_thread->u_large;
+		uint32_t new_pg = DIV_ROUND_UP(size, PG_SIZE);
+		lock_acquire(&mem_pool->lock);
+		struct large_desc* ld = *large_link(table, (uint32_t)ptr);
+		ASSERT(ld != NULL);
+		old_size = ld->pg_cnt * PG_SIZE;
+		if (new_pg < ld->pg_cnt && vaddr_split(PF, ld->vaddr, new_pg)) {
+			mfree_page(PF, (void*)(ld->vaddr + new_pg * PG_SIZE), ld->pg_cnt - new_pg);
+			table->pages -= ld->pg_cnt - new_pg;
+			ld->pg_cnt = new_pg;
+		}
+		bool in_place = new_pg <= ld->pg_cnt || large_extend(PF, table, ld, new_pg);
+		lock_release(&mem_pool->lock);
+		if (in_place) {
+			/* 内核原地扩展出的页框没有清0,与另行分配时get_kernel_pages给的一样清0,这些页已经归自己了,不用持锁清0;
+			 * 用户的新页在第一次访问时才分配清0的页框 */
+			if (PF == PF_KERNEL && new_pg * PG_SIZE > old_size) {
+				memset((void*)((uint32_t)ptr + old_size), 0, new_pg * PG_SIZE - old_size);
+			}
+			return ptr;
+		}
+	}
+
+	void* new_ptr = sys_malloc(size);
+	if (new_ptr != NULL) {
+		memcpy(new_ptr, ptr, old_size);
+		sys_free(ptr);
+	}
+	return new_ptr;
+}
+
+/* realloc_block有多处返回,在这一层计时 */
+void* sys_realloc(void* ptr, uint32_t size) {
+	PERF_BEGIN(t);
+	void* new_ptr = realloc_block(ptr, size);
+	PERF_END(PERF_REALLOC, t);
+	return new_ptr;
+}
+
+/* 打印当前任务(内核线程打印内核的,用户进程打印自己的)各规格内存块的累计分配数、持锁次数和内部碎片率 */
+void malloc_stats(void) {
+	struct task_struct* cur_thread = running_thread();
+	struct mem_block_desc* descs = cur_thread->pgdir == NULL ? k_block_descs : cur_thread->u_block_desc;
+	char buf[64];
+	uint32_t desc_idx;
+	console_put_str("block_size  alloc_cnt  lock_cnt  frag%\n");
+	for (desc_idx = 0; desc_idx < DESC_CNT; desc_idx++) {
+		struct mem_block_desc* desc = &descs[desc_idx];
+		uint32_t frag = 0;
+		if (desc->alloc_cnt != 0) {
+			uint32_t block_bytes = desc->alloc_cnt * desc->block_size;
+			uint32_t waste = block_bytes - desc->req_bytes;
+			/* 累计量大了以后先除后乘,避免waste * 100溢出32位 */
+			frag = block_bytes < 0x1000000 ? waste * 100 / block_bytes : waste / (block_bytes / 100);
+		}
+		sprintf(buf, "%d  %d  %d  %d\n", desc->block_size, desc->alloc_cnt, desc->lock_cnt, frag);
+		console_put_str(buf);
+	}
+	struct large_table* large = cur_thread->pgdir == NULL ? &k_large : &cur_thread->u_large;
+	sprintf(buf, "large blocks: %d  pages: %d  desc bytes: %d\n", large->cnt, large->pages, large->cnt * sizeof(struct large_desc));
+	console_put_str(buf);
+	sprintf(buf, "page tables: %d\n", page_table_cnt);
+	console_put_str(buf);
+	sprintf(buf, "zeroed pages: %d  hits: %d  misses: %d\n", mem_zone.zeroed_cnt, zero_hits, zero_misses);
+	console_put_str(buf);
+	slab_stats();
+	vmem_stats(&kernel_vmem);
+#if PERF_STATS
+	perf_stats();
+#endif
+}
+
+/* 把使用者m_pool的账目填到info中 */
+static void pool_info_fill(struct pool_info* info, struct pool* m_pool) {
+	info->used_pages = m_pool->used_pages;
+	info->min_pages = m_pool->min_pages;
+	info->max_pages = m_pool->max_pages;
+	info->peak_pages = m_pool->peak_pages;
+	info->fail_cnt = m_pool->fail_cnt;
+}
+
+/* 把物理页框的总体使用情况和内核、用户进程各自的账目填到info中 */
+void sys_meminfo(struct meminfo* info) {
+	enum intr_status old_status = intr_disable();	   // 各项取自同一时刻
+	info->total_pages = mem_zone.page_cnt;
+	info->free_pages = mem_zone.free_pages;
+	info->zeroed_pages = mem_zone.zeroed_cnt;
+	info->page_tables = page_table_cnt;
+	pool_info_fill(&info->kernel, &kernel_pool);
+	pool_info_fill(&info->user, &user_pool);
+	intr_set_status(old_status);
+}
+
+/* 把物理页框临时映射到映射槽slot的虚拟页并返回这个虚拟地址,用完马上kunmap.
+ * 每个槽同一时刻只能有一个使用者,怎么保证由槽的用途决定,见enum kmap_slot */
+void* kmap(enum kmap_slot slot, uint32_t pg_phy_addr) {
+	ASSERT(slot != KMAP_TEMP || intr_get_status() == INTR_OFF);
+	uint32_t vaddr = kmap_vaddr + slot * PG_SIZE;
+	uint32_t* pte = pte_ptr(vaddr);
+	ASSERT(!(*pte & PG_P_1));
+	*pte = pg_phy_addr | PG_US_S | PG_RW_W | PG_P_1;
+	invlpg(vaddr);
+	return (void*)vaddr;
+}
+
+/* 撤销kmap在映射槽slot建立的临时映射 */
+void kunmap(enum kmap_slot slot) {
+	uint32_t vaddr = kmap_vaddr + slot * PG_SIZE;
+	*pte_ptr(vaddr) = 0;
+	invlpg(vaddr);
+}
+
+/* 为用户进程的虚拟页vaddr按需分配清0的页框,vaddr须已在某个区域中,或在用户栈可增长的范围内 */
+static bool demand_page(struct task_struct* cur, uint32_t vaddr) {
+	bool reserved = vma_find(&cur->userprog_vmas, vaddr) != NULL;
+	if (!reserved && vaddr < USER_STACK_BOTTOM) {
+		return false;
+	}
+	/* 缺页可能发生在已经持有user_pool.lock的sys_malloc中,lock_acquire允许同一线程重复申请 */
+	lock_acquire(&user_pool.lock);
+	/* 栈向下增长到了新的一页,登记后与已有的栈区域合并 */
+	if (!reserved && !vma_insert(&cur->userprog_vmas, vaddr, vaddr + PG_SIZE, VM_READ | VM_WRITE | VM_STACK)) {
+		lock_release(&user_pool.lock);
+		put_str("\npage fault: out of vma");
+		return false;
+	}
+	void* page_phyaddr = zeroed_palloc(&user_pool);
+	bool zeroed = page_phyaddr != NULL;
+	if (!zeroed) {
+		page_phyaddr = palloc(&user_pool);
+	}
+	if (page_phyaddr == NULL) {
+		lock_release(&user_pool.lock);
+		put_str("\npage fault: out of user memory");
+		return false;
+	}
+	if (!page_table_add((void*)vaddr, page_phyaddr)) {
+		pfree((uint32_t)page_phyaddr);
+		lock_release(&user_pool.lock);
+		put_str("\npage fault: out of page tables");
+		return false;
+	}
+	lock_release(&user_pool.lock);
+	if (!zeroed) {
+		memset((void*)vaddr, 0, PG_SIZE);
+	}
+	return true;
+}
+
+/* 写时复制:页框只剩自己在用时直接恢复可写,否则复制出一个独占的页框再改为可写.
+ * 复制借写时复制专用的kmap槽,全程持有user_pool.lock,这个槽同一时刻只有一个使用者,复制时不必关中断 */
+static bool cow_page(uint32_t vaddr) {
+	lock_acquire(&user_pool.lock);
+	uint32_t* pte = pte_ptr(vaddr);
+	struct page* pg = phy_to_page(*pte & 0xfffff000);
+	if (pg->ref_cnt > 1) {
+		void* page_phyaddr = palloc(&user_pool);
+		if (page_phyaddr == NULL) {
+			lock_release(&user_pool.lock);
+			put_str("\npage fault: out of user memory");
+			return false;
+		}
+		memcpy(kmap(KMAP_COW, (uint32_t)page_phyaddr), (void*)vaddr, PG_SIZE);
+		kunmap(KMAP_COW);
+		pg->ref_cnt--;
+		*pte = (uint32_t)page_phyaddr | PG_US_U | PG_RW_W | PG_P_1;
+	} 
+	else {
+		*pte = (*pte | PG_RW_W) & ~PG_COW;
+	}
+	invlpg(vaddr);
+	lock_release(&user_pool.lock);
+	return true;
+}
+
+/* 缺页异常处理函数,缺页的性质由cr2与页表判断:
+ * 页不存在时,若是用户进程已经预留(落在进程的某个区域中)但还没访问过的页,或栈底以下USER_STACK_SIZE内向下增长的用户栈,
+ * 就分配一个清0的用户页框映射上去;页存在却缺页,只可能是写了打着PG_COW的只读页,做写时复制.
+ * 处理完返回后引起缺页的指令重新执行,其余情况都是真正的非法访问,或者内存不够处理不了.
+ * 错误码表明发生在用户态的,只结束出错的进程;发生在内核态的是内核自己的错,PANIC.
+ * kernel.S在向量号之后还传入了intr_stack的地址frame,错误码和出错时的eflags从中取 */
+static void page_fault_handler(uint8_t vec_nr UNUSED, struct intr_stack* frame) {
+	uint32_t fault_vaddr;
+	asm ("movl %%cr2, %0" : "=r" (fault_vaddr));	  // cr2是存放造成page_fault的地址
+	uint32_t vaddr = fault_vaddr & 0xfffff000;
+	struct task_struct* cur = running_thread();
+
+	/* 进入中断门时cpu关了中断,出错的代码本来开着中断就重新打开,清0和复制页框时可以被抢占 */
+	if (frame->eflags & EFLAGS_IF_1) {
+		intr_enable();
+	}
+
+	if (cur->pgdir != NULL && vaddr >= USER_VADDR_START && vaddr < 0xc0000000) {
+		PERF_BEGIN(t);
+		if (!page_mapped(vaddr)) {
+			if (demand_page(cur, vaddr)) {
+				PERF_END(PERF_DEMAND_FAULT, t);
+				return;
+			}
+		} 
+		else if (*pte_ptr(vaddr) & PG_COW) {
+			if (cow_page(vaddr)) {
+				PERF_END(PERF_COW_FAULT, t);
+				return;
+			}
+		}
+	}
+	put_str("\npage fault addr is ");put_int(fault_vaddr);
+	if (frame->err_code & PF_ERR_USER) {	   // 从用户态进来的,不持有任何锁,可以直接结束
+		put_str(", kill ");put_str(cur->name);put_str("\n");
+		thread_exit();
+	}
+	PANIC("page fault");
+}
+
+/* fork时把当前进程的用户页表复制到子进程的页目录child_pgdir中.只复制页表不复制页:
+ * 可写的页表项在父子两边都改成只读并打上PG_COW,页框引用计数加1,谁先写谁就在缺页时复制一份,
+ * 所以耗时只与页表数有关,与进程已经用了多少内存无关.失败返回false */
+bool user_pgdir_cow_copy(uint32_t* child_pgdir) {
+	bool ok = true;
+	lock_acquire(&user_pool.lock);
+	lock_acquire(&kernel_pool.lock);
+	enum intr_status old_status = intr_disable();	   // kmap要求关中断
+	uint32_t pde_idx, pte_idx;
+	for (pde_idx = 0; pde_idx < PDE_IDX(0xc0000000); pde_idx++) {
+		if (!(*pde_ptr(pde_idx << 22) & PG_P_1)) {
+			continue;
+		}
+		void* table_phyaddr = palloc(&kernel_pool);	  // 页表一律从内核空间分配
+		if (table_phyaddr == NULL) {	  // 已经复制的页表由sys_fork回收子进程时一并释放
+			ok = false;
+			break;
+		}
+		uint32_t* parent_table = pte_ptr(pde_idx << 22);
+		uint32_t* child_table = kmap(KMAP_TEMP, (uint32_t)table_phyaddr);
+		phy_to_page((uint32_t)table_phyaddr)->pte_cnt = phy_to_page(*pde_ptr(pde_idx << 22) & 0xfffff000)->pte_cnt;
+		page_table_cnt++;
+		for (pte_idx = 0; pte_idx < 1024; pte_idx++) {
+			uint32_t pte = parent_table[pte_idx];
+			if (pte & PG_P_1) {
+				if (pte & PG_RW_W) {
+					pte = (pte & ~PG_RW_W) | PG_COW;
+					parent_table[pte_idx] = pte;
+				}
+				phy_to_page(pte & 0xfffff000)->ref_cnt++;
+			}
+			child_table[pte_idx] = pte;
+		}
+		kunmap(KMAP_TEMP);
+		child_pgdir[pde_idx] = (uint32_t)table_phyaddr | PG_US_U | PG_RW_W | PG_P_1;
+	}
+	/* 父进程的页表项刚被改成只读,冲掉tlb中还可写的旧表项 */
+	tlb_flush_all(false);
+	intr_set_status(old_status);
+	lock_release(&kernel_pool.lock);
+	lock_release(&user_pool.lock);
+	return ok;
+}
+
+/* 子进程u_block_desc中各free_list是从父进程pcb复制来的,链表头尾在子进程pcb中,
+ * 但首尾arena结点(在用户空间的arena页里)的前后指针还指着父进程pcb中的链表头尾.
+ * 切到子进程的页目录下把它们改指子进程自己的链表,这些写操作会在子进程一侧触发写时复制 */
+void block_desc_fork(struct task_struct* child_thread, struct task_struct* parent_thread) {
+	/* 持有user_pool.lock,期间的缺页处理重复申请锁不会睡眠,也就不会被换下cpu而装回父进程的页目录 */
+	lock_acquire(&user_pool.lock);
+	page_dir_activate(child_thread);
+	uint32_t desc_idx;
+	for (desc_idx = 0; desc_idx < DESC_CNT; desc_idx++) {
+		struct list* parent_list = &parent_thread->u_block_desc[desc_idx].free_list;
+		struct list* child_list = &child_thread->u_block_desc[desc_idx].free_list;
+		list_init(child_list);
+		if (list_empty(parent_list)) {
+			continue;
+		}
+		child_list->head.next = parent_list->head.next;
+		child_list->tail.prev = parent_list->tail.prev;
+		child_list->head.next->prev = &child_list->head;
+		child_list->tail.prev->next = &child_list->tail;
+#if DEBUG_LEVEL >= 1
+		struct list_elem* elem = child_list->head.next;
+		while (elem != &child_list->tail) {
+			elem->owner = child_list;
+			elem = elem->next;
+		}
+#endif
+	}
+	page_dir_activate(parent_thread);
+	lock_release(&user_pool.lock);
+}
+
 /* 内存管理部分初始化入口 */
 void mem_init() {
    put_str("mem_init start\n");
    uint32_t mem_bytes_total = (*(uint32_t*)(0xb00));
    mem_pool_init(mem_bytes_total);	  // 初始化内存池
+   size_class_init();
    block_desc_init(k_block_descs);
+   vma_init();
+   large_cache = kmem_cache_create("large_desc", sizeof(struct large_desc), 0, NULL);
+   kmap_vaddr = (uint32_t)vaddr_get(PF_KERNEL, KMAP_SLOTS);	  // 只占虚拟页,不分配页框
+   /* 置cr0的WP位,内核写只读页时也要缺页,否则在系统调用中写写时复制的页会直接改到共享的页框 */
+   asm volatile ("movl %%cr0, %%eax; orl $0x10000, %%eax; movl %%eax, %%cr0" : : : "eax", "memory");
+   register_handler(0x0e, page_fault_handler);
    put_str("mem_init done\n");
 }
 
@@ -1,17 +1,29 @@
 #ifndef __KERNEL_MEMORY_H
 #define __KERNEL_MEMORY_H
 #include "stdint.h"
-#include "bitmap.h"
 #include "list.h"
+#include "memdefs.h"
 
-//核心数据结构，虚拟内存池，有一个位图与其管理的起始虚拟地址
-struct virtual_addr {
-   struct bitmap vaddr_bitmap;      // 虚拟地址用到的位图结构 
-   uint32_t vaddr_start;            // 虚拟地址起始地址
+#define MAX_ORDER 10      // 伙伴系统的最高阶,一次最多分配2^10=1024个物理上连续的页框
+#define PAGE_BUDDY 1      // struct page的flags位,表示此页框是伙伴系统中某个空闲块的首页
+#define PAGE_USER 2       // struct page的flags位,表示此页框记在用户进程的账上,否则记在内核的账上
+
+/* 物理页框描述符,每个物理页框都有一个,集中存放在mem_map数组中 */
+struct page {
+   struct list_elem free_elem;   // 此页框是空闲块首页时,用它挂到所属内存池的free_area[order]链表上
+   uint8_t order;                // 空闲块的阶,只对空闲块首页有意义
+   uint8_t flags;                // PAGE_BUDDY等标志
+   uint16_t ref_cnt;             // 映射此页框的页表项数,fork后父子进程写时复制共享时大于1
+   uint16_t pte_cnt;             // 此页框用作用户页表时表中存在的页表项数,减到0就回收这个页表
 };
 
 extern struct pool kernel_pool, user_pool;
+extern struct page* mem_map;
+extern uint32_t tlb_flush_threshold;
+extern uint32_t page_table_cnt;
+extern uint32_t zero_hits, zero_misses;
 void mem_init(void);
+void page_zeroer_init(void);
 
 #define	 PG_P_1	  1	// 页表项或页目录项存在属性位
 #define	 PG_P_0	  0	// 页表项或页目录项存在属性位
@@ -19,6 +31,8 @@ void mem_init(void);
 #define	 PG_RW_W  2	// R/W 属性位值, 读/写/执行
 #define	 PG_US_S  0	// U/S 属性位值, 系统级
 #define	 PG_US_U  4	// U/S 属性位值, 用户级
+#define	 PG_G	  0x100	// 全局页,重新加载cr3时tlb中的此项不会被冲掉,只用于所有进程共享的内核空间
+#define	 PG_COW	  0x200	// 页表项中留给软件使用的AVL位,标记写时复制共享的只读页
 
 
 /* 内存池标记,用于判断用哪个内存池 */
@@ -27,31 +41,87 @@ enum pool_flags {
    PF_USER = 2	     // 用户内存池
 };
 
-/* 内存块 */
+/* kmap的映射槽,每个槽是一个固定的内核虚拟页,各有各的用途,用途决定了同一时刻只有一个使用者 */
+enum kmap_slot {
+   KMAP_TEMP,     // 关中断下短暂使用,如fork时填子进程的页表
+   KMAP_ZERO,     // 后台清0线程专用,只有它一个线程使用,可以开着中断清0
+   KMAP_COW,      // 写时复制专用,持有user_pool.lock时使用,可以开着中断复制
+   KMAP_SLOTS
+};
+
+/* 内存块,空闲时开头存放arena内空闲块单链表的后继指针 */
 struct mem_block {
-   struct list_elem free_elem;
+   struct mem_block* next;
 };
 
 /* 内存块描述符 */
 struct mem_block_desc {
    uint32_t block_size;		 // 内存块大小
    uint32_t blocks_per_arena;	 // 本arena中可容纳此mem_block的数量.
-   struct list free_list;	 // 目前可用的mem_block链表
+   struct list free_list;	 // 还有空闲mem_block的arena链表
+   uint32_t alloc_cnt;           // 统计用:累计分配出去的块数
+   uint32_t req_bytes;           // 统计用:累计被申请的字节数,与alloc_cnt * block_size比较就是内部碎片
+   uint32_t lock_cnt;            // 统计用:申请和释放此规格的块时累计持有内存池锁的次数,与alloc_cnt比较可以看出弹匣省掉了多少次持锁
 };
 
-#define DESC_CNT 7	   // 内存块描述符个数，对应16、32、64、128、256、512、1024这7种小内存块
+#define DESC_CNT 12	   // 内存块描述符个数，对应16、32、48、64、96、128、192、256、384、512、768、1024这12种小内存块
+#define MAX_BLOCK_SIZE 1024    // 最大的小内存块,超过它就直接分配页框
+
+#define MAG_ROUNDS 8                   // 每个弹匣最多缓存的内存块数,弹匣放在pcb里,每线程共DESC_CNT个,不宜太大
+#define MAG_BATCH (MAG_ROUNDS / 2)     // 弹匣空了或满了时,一次持锁补充或归还的内存块数
+
+/* 弹匣:线程私有的某种规格内存块缓存,每个线程每种规格一个。
+ * 线程申请和释放小内存块先在自己的弹匣里进行,不用持有内存池的锁,
+ * 弹匣空了才持锁从mem_block_desc批量取块,满了才持锁批量还回去 */
+struct mem_magazine {
+   uint32_t rounds;                 // 弹匣中现有的内存块数
+   void* blocks[MAG_ROUNDS];        // 缓存的内存块,当作栈使用
+};
+
+#define LARGE_HASH_SIZE 16     // 大块内存描述符散列表的桶数
+
+/* 大块内存描述符:超过MAX_BLOCK_SIZE的申请直接分配整页,起始地址页对齐,元信息不放在页里而是放在这里,
+ * 按起始虚拟页挂在所属散列表中,sys_free凭地址O(1)找到页数 */
+struct large_desc {
+   struct large_desc* next;     // 同一个桶中的下一个
+   uint32_t vaddr;              // 起始虚拟地址
+   uint32_t pg_cnt;             // 页数
+};
+
+/* 大块内存描述符的散列表,内核一个,每个用户进程一个放在pcb里 */
+struct large_table {
+   struct large_desc* buckets[LARGE_HASH_SIZE];
+   uint32_t cnt;                // 现有的大块数
+   uint32_t pages;              // 大块共占的页数
+};
 
 void* get_kernel_pages(uint32_t pg_cnt);
+void* get_kernel_pages_raw(uint32_t pg_cnt);
+void free_kernel_pages(void* vaddr, uint32_t pg_cnt);
 void* malloc_page(enum pool_flags pf, uint32_t pg_cnt);
 void malloc_init(void);
 uint32_t* pte_ptr(uint32_t vaddr);
 uint32_t* pde_ptr(uint32_t vaddr);
 uint32_t addr_v2p(uint32_t vaddr);
 void* get_user_pages(uint32_t pg_cnt);
+void* sys_mmap(void* vaddr, uint32_t pg_cnt);
+int32_t sys_munmap(void* vaddr, uint32_t pg_cnt);
 void* get_a_page(enum pool_flags pf, uint32_t vaddr);
 void block_desc_init(struct mem_block_desc* desc_array);
 void* sys_malloc(uint32_t size);
 void mfree_page(enum pool_flags pf, void* _vaddr, uint32_t pg_cnt);
 void pfree(uint32_t pg_phy_addr);
 void sys_free(void* ptr);
+void* sys_realloc(void* ptr, uint32_t size);
+void malloc_stats(void);
+void sys_meminfo(struct meminfo* info);
+void* kmap(enum kmap_slot slot, uint32_t pg_phy_addr);
+void kunmap(enum kmap_slot slot);
+bool user_pgdir_cow_copy(uint32_t* child_pgdir);
+struct task_struct;
+void block_desc_fork(struct task_struct* child_thread, struct task_struct* parent_thread);
+void block_mags_drain(void);
+bool large_table_copy(struct large_table* dst, struct large_table* src);
+void large_table_destroy(struct large_table* table);
+void user_pgdir_free(void);
 #endif
@@ -0,0 +1,60 @@
+#include "perf.h"
+#include "stdint.h"
+#include "interrupt.h"
+#include "console.h"
+#include "stdio.h"
+#include "timer.h"
+
+#if PERF_STATS
+/* 一种事件的累计值 */
+struct perf_counter {
+   uint32_t cnt;         // 发生次数
+   uint64_t cycles;      // 累计周期数
+   uint32_t max;         // 单次最多的周期数
+};
+
+static struct perf_counter counters[PERF_EVENTS];
+
+static const char* perf_names[PERF_EVENTS] = {
+   "palloc", "pfree", "malloc_small", "free_small", "malloc_large", "free_large", "realloc",
+   "arena_new", "arena_retire", "slab_alloc", "slab_free", "vmem_alloc", "vmem_free", "vma_alloc",
+   "unmap", "demand_fault", "cow_fault", "fork", "switch", "cr3_load", "wakeup"
+};
+
+/* 记一次事件ev,用了cycles个周期.关中断更新,免得与中断处理中的同一事件交错 */
+void perf_add(enum perf_event ev, uint64_t cycles) {
+   enum intr_status old_status = intr_disable();
+   struct perf_counter* c = &counters[ev];
+   c->cnt++;
+   c->cycles += cycles;
+   if (cycles > c->max) {
+      c->max = cycles > 0xffffffff ? 0xffffffff : (uint32_t)cycles;
+   }
+   intr_set_status(old_status);
+}
+
+/* 64位除以32位,商要放得下32位.内核不链接libgcc,不能直接写64位除法(__udivdi3) */
+static uint32_t div64_32(uint64_t n, uint32_t d) {
+   uint32_t hi = (uint32_t)(n >> 32) % d, q;
+   asm ("divl %2" : "=a" (q), "+d" (hi) : "rm" (d), "a" ((uint32_t)n));
+   return q;
+}
+
+/* 打印各事件的次数、平均与最多周期数,以及时钟中断与idle的嘀嗒数 */
+void perf_stats(void) {
+   char buf[80];
+   uint32_t ev;
+   console_put_str("event  cnt  avg_cycles  max_cycles\n");
+   for (ev = 0; ev < PERF_EVENTS; ev++) {
+      enum intr_status old_status = intr_disable();
+      struct perf_counter c = counters[ev];
+      intr_set_status(old_status);
+      if (c.cnt != 0) {
+         sprintf(buf, "%s  %d  %d  %d\n", perf_names[ev], c.cnt, div64_32(c.cycles, c.cnt), c.max);
+         console_put_str(buf);
+      }
+   }
+   sprintf(buf, "ticks: %d  idle: %d  timer interrupts: %d\n", ticks, idle_ticks, timer_intr_cnt);
+   console_put_str(buf);
+}
+#endif
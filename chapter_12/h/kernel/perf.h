@@ -0,0 +1,67 @@
+#ifndef __KERNEL_PERF_H
+#define __KERNEL_PERF_H
+#include "stdint.h"
+
+/* 性能计数,编译时用gcc -DPERF_STATS=1打开,makefile的perf目标在build_perf下编出这一版.
+ * 打开后在下面这些路径的前后各读一次时间戳计数器,按事件累计次数、周期数和最大值,由malloc_stats最后打印;
+ * 关掉时PERF_BEGIN/PERF_END什么也不生成,发行版与默认版的代码不受影响.
+ *
+ * 测得到的:伙伴系统分配与释放页框、小块与大块的sys_malloc/sys_free/sys_realloc、arena上线与退役、
+ * slab对象与内核虚拟地址(vmem)、用户虚拟地址(区域树)的分配、解除映射、缺页与写时复制、fork、
+ * 调度(从进入schedule到switch_to,含装页表)、重装cr3、唤醒到上cpu的延迟;另外打印时钟中断数与idle嘀嗒数.
+ * 用户态的malloc/free由u_prog_a自己用rdtsc测(ring3可以执行rdtsc).
+ *
+ * 测不到的:
+ * 1 改写前的实现已经不在树里,这里只有改写后的数字,要对比得在改写前的提交上加同样的计数
+ *   (位图扫描与内存操作函数例外,改写前的代码抄进了test下的宿主机测试,见makefile的host_test)
+ * 2 tlb未命中本身的代价:模拟器里rdtsc数出的周期反映不了真实硬件上的tlb未命中,只能看每次调度和每次重装cr3的周期数,
+ *   以及重装cr3的次数
+ * 3 idle时宿主机的cpu占用要在宿主机上看,内核里只能给出idle嘀嗒数
+ * 4 内存池锁的持有时间:锁是会睡眠的,持锁期间可能被换下cpu,rdtsc量出的包括别的线程运行的时间 */
+#ifndef PERF_STATS
+#define PERF_STATS 0
+#endif
+
+enum perf_event {
+   PERF_PALLOC,          // 伙伴系统分配1页
+   PERF_PFREE,           // 释放1页
+   PERF_MALLOC_SMALL,    // sys_malloc小块,多数在弹匣里完成
+   PERF_FREE_SMALL,
+   PERF_MALLOC_LARGE,    // sys_malloc大块,整页
+   PERF_FREE_LARGE,
+   PERF_REALLOC,
+   PERF_ARENA_NEW,       // 规格的free_list空了,新建arena并切出第一块
+   PERF_ARENA_RETIRE,    // arena全空闲了,把页还回去
+   PERF_SLAB_ALLOC,
+   PERF_SLAB_FREE,
+   PERF_VMEM_ALLOC,      // 内核虚拟地址
+   PERF_VMEM_FREE,
+   PERF_VMA_ALLOC,       // 用户虚拟地址
+   PERF_UNMAP,           // mfree_page,解除映射、回收页表并归还地址
+   PERF_DEMAND_FAULT,    // 缺页时分配清0的页框
+   PERF_COW_FAULT,       // 写时复制
+   PERF_FORK,
+   PERF_SWITCH,          // schedule从进入到switch_to
+   PERF_CR3_LOAD,        // page_dir_activate重装cr3
+   PERF_WAKEUP,          // thread_unblock到被调度上cpu
+   PERF_EVENTS
+};
+
+/* 读时间戳计数器 */
+static inline uint64_t rdtsc(void) {
+   uint32_t lo, hi;
+   asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+   return ((uint64_t)hi << 32) | lo;
+}
+
+#if PERF_STATS
+void perf_add(enum perf_event ev, uint64_t cycles);
+void perf_stats(void);
+#define PERF_BEGIN(t) uint64_t t = rdtsc()
+#define PERF_END(ev, t) perf_add(ev, rdtsc() - (t))
+#else
+#define PERF_BEGIN(t)
+#define PERF_END(ev, t)
+#endif
+
+#endif
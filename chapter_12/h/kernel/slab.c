@@ -0,0 +1,236 @@
+#include "slab.h"
+#include "stdint.h"
+#include "global.h"
+#include "memory.h"
+#include "interrupt.h"
+#include "console.h"
+#include "stdio.h"
+#include "debug.h"
+#include "perf.h"
+
+#define SLAB_END 0xffff       // 空闲序号链的结尾
+
+/* slab描述符,放在slab所在页的开头,后面紧跟bufctl数组,再往后才是着色偏移和对象 */
+struct slab {
+   struct list_elem slab_elem;   // 挂在所属缓存的partial、full或free链表上
+   struct kmem_cache* cache;
+   uint32_t objs;                // 第0个对象的地址
+   uint16_t inuse;               // 已分配出去的对象数
+   uint16_t free_idx;            // 第一个空闲对象的序号
+   uint16_t bufctl[];            // bufctl[i]是空闲对象i后面的下一个空闲对象的序号
+};
+
+static struct kmem_cache caches[SLAB_CACHE_CNT];
+static uint32_t cache_cnt;
+
+/* 有n个对象时slab描述符连同bufctl数组占的字节数,按对象的对齐取整 */
+static uint32_t slab_hdr_size(uint32_t n, uint32_t align) {
+   return (sizeof(struct slab) + n * sizeof(uint16_t) + align - 1) & ~(align - 1);
+}
+
+/* 新建一个名为name、对象大小为size字节、按align字节对齐的对象缓存,align为0时按4字节对齐.
+ * 缓存只在初始化时创建,个数超过SLAB_CACHE_CNT时PANIC */
+struct kmem_cache* kmem_cache_create(const char* name, uint32_t size, uint32_t align, slab_ctor* ctor) {
+   if (align < sizeof(uint32_t)) {
+      align = sizeof(uint32_t);
+   }
+   ASSERT((align & (align - 1)) == 0 && size > 0 && size <= PG_SIZE);
+   if (cache_cnt == SLAB_CACHE_CNT) {
+      PANIC("kmem_cache_create: too many caches");
+   }
+   struct kmem_cache* cache = &caches[cache_cnt++];
+   cache->name = name;
+   cache->align = align;
+   cache->obj_size = (size + align - 1) & ~(align - 1);
+   cache->ctor = ctor;
+   list_init(&cache->partial);
+   list_init(&cache->full);
+   list_init(&cache->free);
+
+   /* 先按每个对象连同它的bufctl估一个数,再扣掉对齐损失的,直到描述符和对象能放进一页 */
+   uint32_t n = 0;
+   if (cache->obj_size < PG_SIZE) {
+      n = (PG_SIZE - sizeof(struct slab)) / (cache->obj_size + sizeof(uint16_t));
+      while (n > 0 && slab_hdr_size(n, align) + n * cache->obj_size > PG_SIZE) {
+         n--;
+      }
+   }
+   /* 一页放不下描述符加一个对象的,只能按整页对象来建缓存,每个对象独占一页 */
+   if (n == 0) {
+      cache->obj_size = PG_SIZE;
+      cache->objs_per_slab = 1;
+      cache->colour_cnt = 1;
+      return cache;
+   }
+   cache->objs_per_slab = n;
+   cache->colour_cnt = (PG_SIZE - slab_hdr_size(n, align) - n * cache->obj_size) / align + 1;
+   return cache;
+}
+
+/* 给小对象的缓存新建一个slab并构造其中所有的对象,失败返回false.
+ * 申请页框和运行构造函数都在开中断下进行,只有挂链表时关中断 */
+static bool cache_grow(struct kmem_cache* cache) {
+   struct slab* s = get_kernel_pages_raw(1);
+   if (s == NULL) {
+      return false;
+   }
+   s->cache = cache;
+   s->inuse = 0;
+   s->free_idx = 0;
+   uint32_t idx;
+   for (idx = 0; idx < cache->objs_per_slab; idx++) {
+      s->bufctl[idx] = idx + 1 < cache->objs_per_slab ? idx + 1 : SLAB_END;
+   }
+
+   enum intr_status old_status = intr_disable();
+   uint32_t colour = cache->colour_next;
+   cache->colour_next = (colour + 1) % cache->colour_cnt;
+   intr_set_status(old_status);
+
+   s->objs = (uint32_t)s + slab_hdr_size(cache->objs_per_slab, cache->align) + colour * cache->align;
+   if (cache->ctor != NULL) {
+      for (idx = 0; idx < cache->objs_per_slab; idx++) {
+         cache->ctor((void*)(s->objs + idx * cache->obj_size));
+      }
+   }
+
+   old_status = intr_disable();
+   list_append(&cache->free, &s->slab_elem);
+   cache->free_slabs++;
+   cache->slab_cnt++;
+   cache->grow_cnt++;
+   intr_set_status(old_status);
+   return true;
+}
+
+/* 从整页对象的缓存中分配,没有空闲的就申请一页新建 */
+static void* page_obj_alloc(struct kmem_cache* cache) {
+   enum intr_status old_status = intr_disable();
+   if (cache->free_slabs > 0) {
+      void* obj = cache->page_free[--cache->free_slabs];
+      cache->active_objs++;
+      cache->alloc_cnt++;
+      intr_set_status(old_status);
+      return obj;
+   }
+   intr_set_status(old_status);
+
+   void* obj = get_kernel_pages_raw(1);
+   if (obj == NULL) {
+      return NULL;
+   }
+   if (cache->ctor != NULL) {
+      cache->ctor(obj);
+   }
+   old_status = intr_disable();
+   cache->slab_cnt++;
+   cache->grow_cnt++;
+   cache->active_objs++;
+   cache->alloc_cnt++;
+   intr_set_status(old_status);
+   return obj;
+}
+
+/* 从小对象的缓存中分配,没有空闲对象的slab就新建一个 */
+static void* slab_obj_alloc(struct kmem_cache* cache) {
+   enum intr_status old_status = intr_disable();
+   while (list_empty(&cache->partial) && list_empty(&cache->free)) {
+      intr_set_status(old_status);
+      if (!cache_grow(cache)) {
+         return NULL;
+      }
+      intr_disable();
+   }
+
+   /* 先用部分分配的slab,把全空闲的slab留着,需要时可以还给内存池 */
+   struct slab* s;
+   if (!list_empty(&cache->partial)) {
+      s = elem2entry(struct slab, slab_elem, cache->partial.head.next);
+   }
+   else {
+      s = elem2entry(struct slab, slab_elem, list_pop(&cache->free));
+      cache->free_slabs--;
+      list_append(&cache->partial, &s->slab_elem);
+   }
+   uint32_t idx = s->free_idx;
+   ASSERT(idx != SLAB_END);
+   s->free_idx = s->bufctl[idx];
+   if (++s->inuse == cache->objs_per_slab) {
+      list_remove(&s->slab_elem);
+      list_append(&cache->full, &s->slab_elem);
+   }
+   cache->active_objs++;
+   cache->alloc_cnt++;
+   intr_set_status(old_status);
+   return (void*)(s->objs + idx * cache->obj_size);
+}
+
+/* 从缓存cache中分配一个对象,失败返回NULL.对象是构造好的状态,或者是上次释放时的状态;
+ * 没有构造函数时内容是不确定的,由调用者初始化.需要新建slab时会持有内核内存池的锁,可能睡眠 */
+void* kmem_cache_alloc(struct kmem_cache* cache) {
+   PERF_BEGIN(t);
+   void* obj = cache->obj_size == PG_SIZE ? page_obj_alloc(cache) : slab_obj_alloc(cache);
+   PERF_END(PERF_SLAB_ALLOC, t);
+   return obj;
+}
+
+/* 把对象obj还给缓存cache,对象本身不会被改写.
+ * 全空闲的slab超过SLAB_FREE_KEEP个时把页还给内存池,要持有内核内存池的锁,可能睡眠 */
+void kmem_cache_free(struct kmem_cache* cache, void* obj) {
+   PERF_BEGIN(t);
+   void* release = NULL;
+   enum intr_status old_status = intr_disable();
+   ASSERT(cache->active_objs > 0);
+   cache->active_objs--;
+   if (cache->obj_size == PG_SIZE) {
+      ASSERT((uint32_t)obj % PG_SIZE == 0);
+      if (cache->free_slabs < SLAB_FREE_KEEP) {
+         cache->page_free[cache->free_slabs++] = obj;
+      }
+      else {
+         cache->slab_cnt--;
+         release = obj;
+      }
+   }
+   else {
+      struct slab* s = (struct slab*)((uint32_t)obj & 0xfffff000);
+      uint32_t idx = ((uint32_t)obj - s->objs) / cache->obj_size;
+      ASSERT(s->cache == cache && s->objs + idx * cache->obj_size == (uint32_t)obj && s->inuse > 0);
+      s->bufctl[idx] = s->free_idx;
+      s->free_idx = idx;
+      s->inuse--;
+      if (s->inuse == 0) {
+         list_remove(&s->slab_elem);
+         if (cache->free_slabs < SLAB_FREE_KEEP) {
+            list_append(&cache->free, &s->slab_elem);
+            cache->free_slabs++;
+         }
+         else {
+            cache->slab_cnt--;
+            release = s;
+         }
+      }
+      else if (s->inuse == cache->objs_per_slab - 1) {    // 原来是满的
+         list_remove(&s->slab_elem);
+         list_append(&cache->partial, &s->slab_elem);
+      }
+   }
+   intr_set_status(old_status);
+   if (release != NULL) {
+      free_kernel_pages(release, 1);
+   }
+   PERF_END(PERF_SLAB_FREE, t);
+}
+
+/* 打印各对象缓存的对象大小、每slab对象数、在用对象数、slab数和累计的分配与新建slab次数 */
+void slab_stats(void) {
+   char buf[80];
+   uint32_t idx;
+   console_put_str("cache  obj_size  per_slab  active  slabs  allocs  grows\n");
+   for (idx = 0; idx < cache_cnt; idx++) {
+      struct kmem_cache* cache = &caches[idx];
+      sprintf(buf, "%s  %d  %d  %d  %d  %d  %d\n", cache->name, cache->obj_size, cache->objs_per_slab, \
+         cache->active_objs, cache->slab_cnt, cache->alloc_cnt, cache->grow_cnt);
+      console_put_str(buf);
+   }
+}
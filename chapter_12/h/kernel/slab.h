@@ -0,0 +1,40 @@
+#ifndef __KERNEL_SLAB_H
+#define __KERNEL_SLAB_H
+#include "stdint.h"
+#include "list.h"
+
+#define SLAB_CACHE_CNT 16     // 对象缓存的个数上限,缓存都在初始化时建好,不销毁
+#define SLAB_FREE_KEEP 4      // 每个缓存最多留着的全空闲slab数,再多就把页还给内存池
+
+/* 对象构造函数,只在对象所在的slab新建时调用一次,对象释放后保持构造好的状态,再分配时不必重新构造 */
+typedef void slab_ctor(void* obj);
+
+/* 对象缓存:一种固定大小的内核对象的分配器.
+ * 小对象按页切成slab,页开头放slab描述符,描述符后接各对象的空闲序号链,释放时不写对象本身;
+ * 新建的slab依次错开colour个align字节(着色),让各slab中同序号的对象落在不同的cache行上.
+ * 一整页大小的对象(pcb、页目录)没有地方放描述符,每个对象就是一个slab,空闲的留在page_free中;
+ * 一页放不下描述符加一个对象的,对象大小取整到一页,也这样管理 */
+struct kmem_cache {
+   const char* name;
+   uint32_t obj_size;          // 按align向上取整后的对象大小
+   uint32_t align;             // 对象的对齐字节数,2的幂
+   uint32_t objs_per_slab;     // 每个slab容纳的对象数
+   uint32_t colour_cnt;        // 着色偏移的种数,由页内剩余的空间决定
+   uint32_t colour_next;       // 下一个新建的slab用的着色
+   slab_ctor* ctor;            // 对象构造函数,可为NULL,此时新对象的内容是不确定的
+   struct list partial;        // 部分对象已分配的slab
+   struct list full;           // 对象全部已分配的slab
+   struct list free;           // 对象全部空闲的slab
+   uint32_t free_slabs;        // free中的slab数,整页对象时是page_free中的对象数
+   void* page_free[SLAB_FREE_KEEP];   // 整页对象的缓存中空闲的对象
+   uint32_t slab_cnt;          // 现有的slab数
+   uint32_t active_objs;       // 已分配出去的对象数
+   uint32_t alloc_cnt;         // 统计用:累计分配次数
+   uint32_t grow_cnt;          // 统计用:累计新建slab的次数,构造函数只在这时运行
+};
+
+struct kmem_cache* kmem_cache_create(const char* name, uint32_t size, uint32_t align, slab_ctor* ctor);
+void* kmem_cache_alloc(struct kmem_cache* cache);
+void kmem_cache_free(struct kmem_cache* cache, void* obj);
+void slab_stats(void);
+#endif
@@ -0,0 +1,317 @@
+#include "vma.h"
+#include "stdint.h"
+#include "global.h"
+#include "memory.h"
+#include "slab.h"
+#include "debug.h"
+
+static struct kmem_cache* vma_cache;    // 区域结点的对象缓存
+
+/* 初始化区域结点的分配器 */
+void vma_init(void) {
+   vma_cache = kmem_cache_create("vma", sizeof(struct vma), 0, NULL);
+}
+
+/* 申请一个区域结点,失败返回NULL */
+static struct vma* vma_node_alloc(void) {
+   return kmem_cache_alloc(vma_cache);
+}
+
+/* 归还区域结点 */
+static void vma_node_free(struct vma* v) {
+   kmem_cache_free(vma_cache, v);
+}
+
+static int32_t vma_height(struct vma* v) {
+   return v == NULL ? 0 : v->height;
+}
+
+/* 由左右孩子重新计算结点v的高度、子树地址范围和最大空闲间隙.
+ * 子树内的空闲间隙只有四处:左子树内部、左子树末尾到v、v到右子树开头、右子树内部 */
+static void vma_update(struct vma* v) {
+   int32_t hl = vma_height(v->left), hr = vma_height(v->right);
+   uint32_t gap = 0;
+   v->height = (hl > hr ? hl : hr) + 1;
+   v->lo = v->left != NULL ? v->left->lo : v->start;
+   v->hi = v->right != NULL ? v->right->hi : v->end;
+   if (v->left != NULL) {
+      gap = v->left->max_gap;
+      if (v->start - v->left->hi > gap) {
+         gap = v->start - v->left->hi;
+      }
+   }
+   if (v->right != NULL) {
+      if (v->right->max_gap > gap) {
+         gap = v->right->max_gap;
+      }
+      if (v->right->lo - v->end > gap) {
+         gap = v->right->lo - v->end;
+      }
+   }
+   v->max_gap = gap;
+}
+
+static struct vma* vma_rotate_right(struct vma* v) {
+   struct vma* l = v->left;
+   v->left = l->right;
+   l->right = v;
+   vma_update(v);
+   vma_update(l);
+   return l;
+}
+
+static struct vma* vma_rotate_left(struct vma* v) {
+   struct vma* r = v->right;
+   v->right = r->left;
+   r->left = v;
+   vma_update(v);
+   vma_update(r);
+   return r;
+}
+
+/* 孩子变化后更新v,左右高度差超过1时旋转,返回子树新的根 */
+static struct vma* vma_balance(struct vma* v) {
+   vma_update(v);
+   int32_t diff = vma_height(v->left) - vma_height(v->right);
+   if (diff > 1) {
+      if (vma_height(v->left->left) < vma_height(v->left->right)) {
+         v->left = vma_rotate_left(v->left);
+      }
+      return vma_rotate_right(v);
+   }
+   if (diff < -1) {
+      if (vma_height(v->right->right) < vma_height(v->right->left)) {
+         v->right = vma_rotate_right(v->right);
+      }
+      return vma_rotate_left(v);
+   }
+   return v;
+}
+
+/* 把结点node插入以root为根的子树,返回子树新的根 */
+static struct vma* vma_link(struct vma* root, struct vma* node) {
+   if (root == NULL) {
+      node->left = node->right = NULL;
+      vma_update(node);
+      return node;
+   }
+   if (node->start < root->start) {
+      root->left = vma_link(root->left, node);
+   } else {
+      root->right = vma_link(root->right, node);
+   }
+   return vma_balance(root);
+}
+
+/* 摘下子树v中起始地址最低的结点存入*min,返回子树新的根 */
+static struct vma* vma_unlink_min(struct vma* v, struct vma** min) {
+   if (v->left == NULL) {
+      *min = v;
+      return v->right;
+   }
+   v->left = vma_unlink_min(v->left, min);
+   return vma_balance(v);
+}
+
+/* 从以root为根的子树中摘下起始地址为start的结点(结点本身不释放),返回子树新的根 */
+static struct vma* vma_unlink(struct vma* root, uint32_t start) {
+   ASSERT(root != NULL);
+   if (start < root->start) {
+      root->left = vma_unlink(root->left, start);
+   } else if (start > root->start) {
+      root->right = vma_unlink(root->right, start);
+   } else {
+      struct vma* min;
+      if (root->right == NULL) {
+         return root->left;
+      }
+      struct vma* right = vma_unlink_min(root->right, &min);
+      min->left = root->left;
+      min->right = right;
+      root = min;
+   }
+   return vma_balance(root);
+}
+
+/* 找与[start, end)有重叠的任一区域,没有则返回NULL */
+static struct vma* vma_overlap(struct vma_tree* tree, uint32_t start, uint32_t end) {
+   struct vma* v = tree->root;
+   while (v != NULL) {
+      if (end <= v->start) {
+         v = v->left;
+      } else if (start >= v->end) {
+         v = v->right;
+      } else {
+         return v;
+      }
+   }
+   return NULL;
+}
+
+/* 在子树v内部的空闲间隙中找最低的、不小于size字节的一个,返回其起始地址,没有则返回0 */
+static uint32_t vma_gap_find(struct vma* v, uint32_t size) {
+   while (v != NULL && v->max_gap >= size) {
+      if (v->left != NULL && v->left->max_gap >= size) {
+         v = v->left;
+      } else if (v->left != NULL && v->start - v->left->hi >= size) {
+         return v->left->hi;
+      } else if (v->right != NULL && v->right->lo - v->end >= size) {
+         return v->end;
+      } else {
+         v = v->right;
+      }
+   }
+   return 0;
+}
+
+/* 初始化用户进程的虚拟地址空间,可分配的范围是[vaddr_start, vaddr_end) */
+void vma_tree_init(struct vma_tree* tree, uint32_t vaddr_start, uint32_t vaddr_end) {
+   tree->root = NULL;
+   tree->vaddr_start = vaddr_start;
+   tree->vaddr_end = vaddr_end;
+   tree->vma_cnt = 0;
+}
+
+/* 返回地址vaddr所在的区域,vaddr不在任何区域中则返回NULL */
+struct vma* vma_find(struct vma_tree* tree, uint32_t vaddr) {
+   return vma_overlap(tree, vaddr, vaddr + 1);
+}
+
+/* 把[start, end)登记为占用的区域,与前后相邻且标志相同的区域合并成一个.
+ * 这段地址原先必须是空闲的,结点申请失败返回false */
+bool vma_insert(struct vma_tree* tree, uint32_t start, uint32_t end, uint32_t flags) {
+   ASSERT(start < end && start % PG_SIZE == 0 && end % PG_SIZE == 0);
+   ASSERT(vma_overlap(tree, start, end) == NULL);
+   struct vma* v = NULL;
+   struct vma* prev = vma_find(tree, start - 1);    // 只可能是结束于start的那个区域
+   struct vma* next = vma_find(tree, end);          // 只可能是开始于end的那个区域
+
+   /* 合并时沿用被合并区域的结点,不必申请新的 */
+   if (prev != NULL && prev->flags == flags) {
+      tree->root = vma_unlink(tree->root, prev->start);
+      tree->vma_cnt--;
+      start = prev->start;
+      v = prev;
+   }
+   if (next != NULL && next->flags == flags) {
+      tree->root = vma_unlink(tree->root, next->start);
+      tree->vma_cnt--;
+      end = next->end;
+      if (v == NULL) {
+         v = next;
+      } else {
+         vma_node_free(next);
+      }
+   }
+   if (v == NULL && (v = vma_node_alloc()) == NULL) {
+      return false;
+   }
+   v->start = start;
+   v->end = end;
+   v->flags = flags;
+   tree->root = vma_link(tree->root, v);
+   tree->vma_cnt++;
+   return true;
+}
+
+/* 把指定的[start, end)登记为区域,这段地址越出可分配的范围或有一部分已被占用时返回false,
+ * 用于在已有区域之后原地扩展或在指定地址映射 */
+bool vma_try_insert(struct vma_tree* tree, uint32_t start, uint32_t end, uint32_t flags) {
+   if (start < tree->vaddr_start || end > tree->vaddr_end || start >= end || \
+      vma_overlap(tree, start, end) != NULL) {
+      return false;
+   }
+   return vma_insert(tree, start, end, flags);
+}
+
+/* 找一段pg_cnt页的空闲地址登记为区域,与原先位图的首次适配一样取最低的那段,
+ * 成功返回起始地址,失败返回0 */
+uint32_t vma_alloc(struct vma_tree* tree, uint32_t pg_cnt, uint32_t flags) {
+   uint32_t size = pg_cnt * PG_SIZE, start;
+   struct vma* root = tree->root;
+   if (root == NULL || root->lo >= tree->vaddr_start + size) {      // 最低的区域之前够用
+      start = tree->vaddr_start;
+   } else if ((start = vma_gap_find(root, size)) == 0) {           // 区域之间的间隙都不够,只能放在最高的区域之后
+      start = root->hi;
+   }
+   /* 找到的已经是最低的一段,它越过了上限,更高的也都越过了 */
+   if (start + size > tree->vaddr_end || start + size < start) {
+      return 0;
+   }
+   return vma_insert(tree, start, start + size, flags) ? start : 0;
+}
+
+/* 把[start, end)从占用的区域中去掉,区域只有一部分落在其中时保留剩下的部分.
+ * 要把一个区域从中间拆成两个而结点申请失败时,什么也不改并返回false */
+bool vma_remove(struct vma_tree* tree, uint32_t start, uint32_t end) {
+   struct vma* v;
+   while ((v = vma_overlap(tree, start, end)) != NULL) {
+      uint32_t v_start = v->start, v_end = v->end;
+      struct vma* tail = NULL;
+      if (v_start < start && v_end > end && (tail = vma_node_alloc()) == NULL) {
+         return false;
+      }
+      tree->root = vma_unlink(tree->root, v_start);
+      tree->vma_cnt--;
+      if (v_start < start) {      // 保留前面的部分
+         v->end = start;
+         tree->root = vma_link(tree->root, v);
+         tree->vma_cnt++;
+         v = tail;
+      }
+      if (v_end > end) {          // 保留后面的部分
+         v->start = end;
+         v->end = v_end;
+         tree->root = vma_link(tree->root, v);
+         tree->vma_cnt++;
+         v = NULL;
+      }
+      if (v != NULL) {
+         vma_node_free(v);
+      }
+   }
+   return true;
+}
+
+/* 释放子树v的所有结点 */
+static void vma_free_subtree(struct vma* v) {
+   if (v != NULL) {
+      vma_free_subtree(v->left);
+      vma_free_subtree(v->right);
+      vma_node_free(v);
+   }
+}
+
+/* 复制子树v,连同平衡和间隙信息原样照搬.*ok在结点申请失败时置为false */
+static struct vma* vma_clone(struct vma* v, bool* ok) {
+   if (v == NULL || !*ok) {
+      return NULL;
+   }
+   struct vma* copy = vma_node_alloc();
+   if (copy == NULL) {
+      *ok = false;
+      return NULL;
+   }
+   *copy = *v;
+   copy->left = vma_clone(v->left, ok);
+   copy->right = vma_clone(v->right, ok);
+   return copy;
+}
+
+/* fork时把src的区域原样复制给dst,失败时dst为空树并返回false */
+bool vma_tree_copy(struct vma_tree* dst, struct vma_tree* src) {
+   bool ok = true;
+   *dst = *src;
+   dst->root = vma_clone(src->root, &ok);
+   if (!ok) {
+      vma_tree_destroy(dst);
+   }
+   return ok;
+}
+
+/* 释放地址空间中所有的区域结点 */
+void vma_tree_destroy(struct vma_tree* tree) {
+   vma_free_subtree(tree->root);
+   tree->root = NULL;
+   tree->vma_cnt = 0;
+}
@@ -0,0 +1,43 @@
+#ifndef __KERNEL_VMA_H
+#define __KERNEL_VMA_H
+#include "stdint.h"
+#include "global.h"
+
+#define VM_READ  1     // 区域可读
+#define VM_WRITE 2     // 区域可写
+#define VM_EXEC  4     // 区域可执行
+#define VM_STACK 8     // 用户栈,缺页时向下增长出来的区域
+
+/* 虚拟内存区域:用户进程地址空间中一段已经占用的连续虚拟页[start, end),
+ * 按起始地址组织成avl树,每个结点额外记录子树的地址范围和其中最大的空闲间隙,
+ * 这样找一段够大的空闲地址和查找某个地址所在的区域都是O(log n) */
+struct vma {
+   uint32_t start;         // 起始虚拟地址,页对齐
+   uint32_t end;           // 结束虚拟地址(不含),页对齐
+   uint32_t flags;         // VM_READ等权限标志,相邻且标志相同的区域会合并
+   struct vma* left;
+   struct vma* right;
+   int32_t height;         // 以此结点为根的子树高度,叶子为1
+   uint32_t lo;            // 子树中最低的起始地址
+   uint32_t hi;            // 子树中最高的结束地址
+   uint32_t max_gap;       // 子树[lo, hi)范围内最大的空闲间隙字节数
+};
+
+/* 一个用户进程的虚拟地址空间,直接放在pcb里,区域结点按需从vma对象缓存申请 */
+struct vma_tree {
+   struct vma* root;
+   uint32_t vaddr_start;   // 可分配的最低地址
+   uint32_t vaddr_end;     // vma_alloc分配的上限,其上留给向下增长的用户栈
+   uint32_t vma_cnt;       // 树中的区域数
+};
+
+void vma_init(void);
+void vma_tree_init(struct vma_tree* tree, uint32_t vaddr_start, uint32_t vaddr_end);
+struct vma* vma_find(struct vma_tree* tree, uint32_t vaddr);
+bool vma_insert(struct vma_tree* tree, uint32_t start, uint32_t end, uint32_t flags);
+bool vma_try_insert(struct vma_tree* tree, uint32_t start, uint32_t end, uint32_t flags);
+uint32_t vma_alloc(struct vma_tree* tree, uint32_t pg_cnt, uint32_t flags);
+bool vma_remove(struct vma_tree* tree, uint32_t start, uint32_t end);
+bool vma_tree_copy(struct vma_tree* dst, struct vma_tree* src);
+void vma_tree_destroy(struct vma_tree* tree);
+#endif
@@ -0,0 +1,410 @@
+#include "vmem.h"
+#include "stdint.h"
+#include "global.h"
+#include "memory.h"
+#include "interrupt.h"
+#include "console.h"
+#include "stdio.h"
+#include "debug.h"
+
+#define VMEM_BOOT_SEGS 16     // 静态预备的段描述符数,页分配器还不能用时先用它们
+#define VMEM_SEG_RESERVE 8    // 每次操作前保证手头至少有这么多段描述符,一次操作(连同导入)最多用掉5个
+
+enum vmem_seg_type {
+   VMEM_FREE,     // 空闲段,挂在freelist中
+   VMEM_ALLOC,    // 已分配的段,挂在hash中
+   VMEM_SPAN      // span的打头标记,不挂在freelist和hash中,使合并不会跨过span的边界
+};
+
+/* 段描述符,即边界标签 */
+struct vmem_seg {
+   uint32_t start;
+   uint32_t size;
+   enum vmem_seg_type type;
+   bool imported;                  // 只对span段有意义:是否是从source导入的
+   struct list_elem seg_elem;      // 在seglist中的结点
+   struct list_elem link_elem;     // 空闲段在freelist中、已分配的段在hash中的结点
+};
+
+/* 空闲的段描述符,所有vmem共用.不够时整页申请切开,页不再归还 */
+static struct vmem_seg boot_segs[VMEM_BOOT_SEGS];
+static struct list seg_pool;
+static uint32_t seg_pool_cnt;
+static bool seg_pool_ready;
+static bool seg_populating;        // 正在为seg_pool申请页,申请页时又会分配内核虚拟地址,这时只能动用预留的描述符
+
+/* 取一个空闲的段描述符,没有时返回NULL */
+static struct vmem_seg* seg_get(void) {
+   struct vmem_seg* seg = NULL;
+   enum intr_status old_status = intr_disable();
+   if (seg_pool_cnt > 0) {
+      seg = elem2entry(struct vmem_seg, seg_elem, list_pop(&seg_pool));
+      seg_pool_cnt--;
+   }
+   intr_set_status(old_status);
+   return seg;
+}
+
+/* 归还段描述符 */
+static void seg_put(struct vmem_seg* seg) {
+   enum intr_status old_status = intr_disable();
+   list_push(&seg_pool, &seg->seg_elem);
+   seg_pool_cnt++;
+   intr_set_status(old_status);
+}
+
+/* 在持有vmem的锁之前调用,保证手头有VMEM_SEG_RESERVE个段描述符,不够就申请一页切开.
+ * 申请页时要分配内核虚拟地址,又会走到这里,此时直接返回,用预留的那几个 */
+static void seg_reserve(void) {
+   enum intr_status old_status = intr_disable();
+   bool need = seg_pool_cnt < VMEM_SEG_RESERVE && !seg_populating;
+   if (need) {
+      seg_populating = true;
+   }
+   intr_set_status(old_status);
+   if (!need) {
+      return;
+   }
+   struct vmem_seg* page = get_kernel_pages_raw(1);
+   uint32_t idx;
+   for (idx = 0; page != NULL && idx < PG_SIZE / sizeof(struct vmem_seg); idx++) {
+      seg_put(&page[idx]);
+   }
+   seg_populating = false;
+}
+
+/* 最高的1所在的位 */
+static uint32_t highbit(uint32_t x) {
+   uint32_t bit;
+   asm ("bsrl %1, %0" : "=r" (bit) : "rm" (x));
+   return bit;
+}
+
+/* 最低的1所在的位 */
+static uint32_t lowbit(uint32_t x) {
+   uint32_t bit;
+   asm ("bsfl %1, %0" : "=r" (bit) : "rm" (x));
+   return bit;
+}
+
+static void freelist_insert(struct vmem* vm, struct vmem_seg* seg) {
+   uint32_t idx = highbit(seg->size);
+   list_push(&vm->freelist[idx], &seg->link_elem);
+   vm->freemap |= 1u << idx;
+}
+
+static void freelist_remove(struct vmem* vm, struct vmem_seg* seg) {
+   uint32_t idx = highbit(seg->size);
+   list_remove(&seg->link_elem);
+   if (list_empty(&vm->freelist[idx])) {
+      vm->freemap &= ~(1u << idx);
+   }
+}
+
+static struct list* hash_bucket(struct vmem* vm, uint32_t addr) {
+   return &vm->hash[(addr / vm->quantum) % VMEM_HASH_SIZE];
+}
+
+/* 找起始地址为addr的已分配段,没有则返回NULL */
+static struct vmem_seg* hash_find(struct vmem* vm, uint32_t addr) {
+   struct list* bucket = hash_bucket(vm, addr);
+   struct list_elem* elem = bucket->head.next;
+   while (elem != &bucket->tail) {
+      struct vmem_seg* seg = elem2entry(struct vmem_seg, link_elem, elem);
+      if (seg->start == addr) {
+         return seg;
+      }
+      elem = elem->next;
+   }
+   return NULL;
+}
+
+/* seglist中紧挨在seg之前和之后的段,没有则返回NULL */
+static struct vmem_seg* seg_prev(struct vmem* vm, struct vmem_seg* seg) {
+   struct list_elem* elem = seg->seg_elem.prev;
+   return elem == &vm->seglist.head ? NULL : elem2entry(struct vmem_seg, seg_elem, elem);
+}
+
+static struct vmem_seg* seg_next(struct vmem* vm, struct vmem_seg* seg) {
+   struct list_elem* elem = seg->seg_elem.next;
+   return elem == &vm->seglist.tail ? NULL : elem2entry(struct vmem_seg, seg_elem, elem);
+}
+
+/* 新建一个类型为type的段[start, start + size),插在seglist的before结点之前 */
+static void seg_insert(struct list_elem* before, struct vmem_seg* seg, uint32_t start, uint32_t size, enum vmem_seg_type type) {
+   seg->start = start;
+   seg->size = size;
+   seg->type = type;
+   seg->imported = false;
+   list_insert_before(before, &seg->seg_elem);
+}
+
+/* 把[base, base + size)作为一个span加入vm,整段空闲.调用者持有vm的锁,段描述符不够时返回false */
+static bool span_add(struct vmem* vm, uint32_t base, uint32_t size, bool imported) {
+   struct vmem_seg* span = seg_get();
+   struct vmem_seg* free = seg_get();
+   if (span == NULL || free == NULL) {
+      if (span != NULL) {
+         seg_put(span);
+      }
+      if (free != NULL) {
+         seg_put(free);
+      }
+      return false;
+   }
+   /* span之间按地址排列,找到第一个在它之后的段,span不多,逐个看就行 */
+   struct list_elem* pos = vm->seglist.head.next;
+   while (pos != &vm->seglist.tail) {
+      struct vmem_seg* seg = elem2entry(struct vmem_seg, seg_elem, pos);
+      if (seg->start > base) {
+         break;
+      }
+      pos = pos->next;
+   }
+   seg_insert(pos, span, base, size, VMEM_SPAN);
+   span->imported = imported;
+   seg_insert(pos, free, base, size, VMEM_FREE);
+   freelist_insert(vm, free);
+   vm->total += size;
+   return true;
+}
+
+/* 找一个不小于size字节的空闲段,没有则返回NULL.
+ * 比size高一级及以上的各级中任何一个段都够大,取最低的非空级别的队首即可;
+ * 只有size所在的那一级需要逐个比较,而且只在更高的级别都空了时才看 */
+static struct vmem_seg* seg_find_fit(struct vmem* vm, uint32_t size) {
+   uint32_t idx = highbit(size);
+   uint32_t first = (size & (size - 1)) == 0 ? idx : idx + 1;     // 2的幂时本级的段都够大
+   uint32_t mask = first < VMEM_FREELISTS ? vm->freemap & ~((1u << first) - 1) : 0;
+   if (mask != 0) {
+      return elem2entry(struct vmem_seg, link_elem, vm->freelist[lowbit(mask)].head.next);
+   }
+   struct list_elem* elem = vm->freelist[idx].head.next;
+   while (elem != &vm->freelist[idx].tail) {
+      struct vmem_seg* seg = elem2entry(struct vmem_seg, link_elem, elem);
+      if (seg->size >= size) {
+         return seg;
+      }
+      elem = elem->next;
+   }
+   return NULL;
+}
+
+/* 从空闲段seg中把[addr, addr + size)切出来分配掉,前后剩下的部分仍是空闲段.
+ * 调用者持有vm的锁,段描述符不够时什么也不改并返回false */
+static bool seg_carve(struct vmem* vm, struct vmem_seg* seg, uint32_t addr, uint32_t size) {
+   ASSERT(seg->type == VMEM_FREE && addr >= seg->start && addr + size <= seg->start + seg->size);
+   uint32_t end = seg->start + seg->size;
+   struct vmem_seg* left = addr > seg->start ? seg_get() : NULL;
+   struct vmem_seg* right = addr + size < end ? seg_get() : NULL;
+   if ((addr > seg->start && left == NULL) || (addr + size < end && right == NULL)) {
+      if (left != NULL) {
+         seg_put(left);
+      }
+      if (right != NULL) {
+         seg_put(right);
+      }
+      return false;
+   }
+   freelist_remove(vm, seg);
+   if (left != NULL) {
+      seg_insert(&seg->seg_elem, left, seg->start, addr - seg->start, VMEM_FREE);
+      freelist_insert(vm, left);
+   }
+   if (right != NULL) {
+      seg_insert(seg->seg_elem.next, right, addr + size, end - addr - size, VMEM_FREE);
+      freelist_insert(vm, right);
+   }
+   seg->start = addr;
+   seg->size = size;
+   seg->type = VMEM_ALLOC;
+   list_push(hash_bucket(vm, addr), &seg->link_elem);
+   vm->in_use += size;
+   vm->alloc_cnt++;
+   return true;
+}
+
+/* 初始化vm,以quantum为分配单位,size不为0时以[base, base + size)为第一个span.
+ * source不为NULL时,资源不够就从source导入至少import_size字节 */
+void vmem_create(struct vmem* vm, const char* name, uint32_t base, uint32_t size, uint32_t quantum, \
+   struct vmem* source, uint32_t import_size) {
+   ASSERT(quantum > 0 && (quantum & (quantum - 1)) == 0);
+   enum intr_status old_status = intr_disable();
+   if (!seg_pool_ready) {
+      uint32_t idx;
+      list_init(&seg_pool);
+      seg_pool_ready = true;
+      for (idx = 0; idx < VMEM_BOOT_SEGS; idx++) {
+         list_push(&seg_pool, &boot_segs[idx].seg_elem);
+         seg_pool_cnt++;
+      }
+   }
+   intr_set_status(old_status);
+
+   uint32_t idx;
+   vm->name = name;
+   vm->quantum = quantum;
+   vm->source = source;
+   vm->import_size = import_size;
+   list_init(&vm->seglist);
+   for (idx = 0; idx < VMEM_FREELISTS; idx++) {
+      list_init(&vm->freelist[idx]);
+   }
+   for (idx = 0; idx < VMEM_HASH_SIZE; idx++) {
+      list_init(&vm->hash[idx]);
+   }
+   vm->freemap = 0;
+   lock_init(&vm->lock);
+   vm->total = vm->in_use = vm->alloc_cnt = vm->import_cnt = 0;
+   if (size != 0 && !span_add(vm, base, size, false)) {
+      PANIC("vmem_create: out of segments");
+   }
+}
+
+/* 从vm中分配size字节(向上取整到quantum),成功返回起始地址,失败返回0 */
+uint32_t vmem_alloc(struct vmem* vm, uint32_t size) {
+   ASSERT(size > 0);
+   size = (size + vm->quantum - 1) & ~(vm->quantum - 1);
+   seg_reserve();
+   lock_acquire(&vm->lock);
+   struct vmem_seg* seg = seg_find_fit(vm, size);
+   if (seg == NULL && vm->source != NULL) {
+      uint32_t span_size = size > vm->import_size ? size : vm->import_size;
+      uint32_t base = vmem_alloc(vm->source, span_size);
+      if (base != 0) {
+         if (span_add(vm, base, span_size, true)) {
+            vm->import_cnt++;
+            seg = seg_find_fit(vm, size);
+         }
+         else {
+            vmem_free(vm->source, base, span_size);
+         }
+      }
+   }
+   uint32_t addr = 0;
+   if (seg != NULL && seg_carve(vm, seg, seg->start, size)) {
+      addr = seg->start;
+   }
+   lock_release(&vm->lock);
+   return addr;
+}
+
+/* 分配指定的[addr, addr + size),这段资源必须整个落在一个空闲段中,成功返回addr,失败返回0.
+ * 要按地址逐段查找,只用于少见的指定地址分配 */
+uint32_t vmem_xalloc(struct vmem* vm, uint32_t addr, uint32_t size) {
+   ASSERT(size > 0 && addr % vm->quantum == 0);
+   size = (size + vm->quantum - 1) & ~(vm->quantum - 1);
+   seg_reserve();
+   lock_acquire(&vm->lock);
+   struct list_elem* elem = vm->seglist.head.next;
+   uint32_t ret = 0;
+   while (elem != &vm->seglist.tail) {
+      struct vmem_seg* seg = elem2entry(struct vmem_seg, seg_elem, elem);
+      if (seg->type != VMEM_SPAN && addr >= seg->start && addr - seg->start < seg->size) {
+         if (seg->type == VMEM_FREE && size <= seg->start + seg->size - addr && seg_carve(vm, seg, addr, size)) {
+            ret = addr;
+         }
+         break;
+      }
+      elem = elem->next;
+   }
+   lock_release(&vm->lock);
+   return ret;
+}
+
+/* 把从addr起始的已分配段原地向后扩展add字节,紧接着的不是足够大的空闲段时返回false */
+bool vmem_grow(struct vmem* vm, uint32_t addr, uint32_t add) {
+   add = (add + vm->quantum - 1) & ~(vm->quantum - 1);
+   lock_acquire(&vm->lock);
+   struct vmem_seg* seg = hash_find(vm, addr);
+   ASSERT(seg != NULL && seg->type == VMEM_ALLOC);
+   struct vmem_seg* next = seg_next(vm, seg);
+   bool ok = next != NULL && next->type == VMEM_FREE && next->size >= add;
+   if (ok) {
+      freelist_remove(vm, next);
+      if (next->size == add) {
+         list_remove(&next->seg_elem);
+         seg_put(next);
+      }
+      else {
+         next->start += add;
+         next->size -= add;
+         freelist_insert(vm, next);
+      }
+      seg->size += add;
+      vm->in_use += add;
+   }
+   lock_release(&vm->lock);
+   return ok;
+}
+
+/* 把从addr起始的已分配段拆成前keep字节和其余部分两个已分配段,之后可以单独释放后一段.
+ * 段描述符不够时返回false */
+bool vmem_split(struct vmem* vm, uint32_t addr, uint32_t keep) {
+   seg_reserve();
+   lock_acquire(&vm->lock);
+   struct vmem_seg* seg = hash_find(vm, addr);
+   ASSERT(seg != NULL && seg->type == VMEM_ALLOC && keep > 0 && keep < seg->size && keep % vm->quantum == 0);
+   struct vmem_seg* tail = seg_get();
+   if (tail != NULL) {
+      seg_insert(seg->seg_elem.next, tail, addr + keep, seg->size - keep, VMEM_ALLOC);
+      list_push(hash_bucket(vm, tail->start), &tail->link_elem);
+      seg->size = keep;
+   }
+   lock_release(&vm->lock);
+   return tail != NULL;
+}
+
+/* 释放vmem_alloc等分配的从addr起始的size字节,与前后的空闲段合并,
+ * 合并后正好是一整个导入的span时还给source */
+void vmem_free(struct vmem* vm, uint32_t addr, uint32_t size) {
+   size = (size + vm->quantum - 1) & ~(vm->quantum - 1);
+   lock_acquire(&vm->lock);
+   struct vmem_seg* seg = hash_find(vm, addr);
+   ASSERT(seg != NULL && seg->type == VMEM_ALLOC && seg->size == size);
+   list_remove(&seg->link_elem);
+   seg->type = VMEM_FREE;
+   vm->in_use -= size;
+
+   struct vmem_seg* prev = seg_prev(vm, seg);
+   if (prev != NULL && prev->type == VMEM_FREE) {
+      freelist_remove(vm, prev);
+      seg->start = prev->start;
+      seg->size += prev->size;
+      list_remove(&prev->seg_elem);
+      seg_put(prev);
+   }
+   struct vmem_seg* next = seg_next(vm, seg);
+   if (next != NULL && next->type == VMEM_FREE) {
+      freelist_remove(vm, next);
+      seg->size += next->size;
+      list_remove(&next->seg_elem);
+      seg_put(next);
+   }
+
+   prev = seg_prev(vm, seg);
+   if (prev != NULL && prev->imported && prev->start == seg->start && prev->size == seg->size) {
+      uint32_t span_start = seg->start, span_size = seg->size;
+      list_remove(&prev->seg_elem);
+      list_remove(&seg->seg_elem);
+      seg_put(prev);
+      seg_put(seg);
+      vm->total -= span_size;
+      lock_release(&vm->lock);
+      vmem_free(vm->source, span_start, span_size);
+      return;
+   }
+   freelist_insert(vm, seg);
+   lock_release(&vm->lock);
+}
+
+/* 打印vm的总量、在用量、最大的空闲段所在的级别和累计的分配、导入次数 */
+void vmem_stats(struct vmem* vm) {
+   char buf[96];
+   enum intr_status old_status = intr_disable();
+   int32_t top = vm->freemap == 0 ? -1 : (int32_t)highbit(vm->freemap);
+   sprintf(buf, "vmem %s: total %d  in_use %d  largest free >= %d  allocs %d  imports %d\n", vm->name, \
+      vm->total, vm->in_use, top < 0 ? 0 : 1 << top, vm->alloc_cnt, vm->import_cnt);
+   intr_set_status(old_status);
+   console_put_str(buf);
+}
@@ -0,0 +1,38 @@
+#ifndef __KERNEL_VMEM_H
+#define __KERNEL_VMEM_H
+#include "stdint.h"
+#include "list.h"
+#include "sync.h"
+
+#define VMEM_FREELISTS 32     // 空闲段按大小分级的链表数,第i级放大小在[2^i, 2^(i+1))字节的段
+#define VMEM_HASH_SIZE 64     // 已分配段散列表的桶数
+
+/* vmem资源分配器:管理一段或几段整数资源(这里是内核虚拟地址),按quantum为单位分配连续的一段.
+ * 资源被切成首尾相接的段,按地址串在seglist中,段就是边界标签,释放时直接与前后的空闲段合并;
+ * 空闲段按大小的2的幂分级,申请时直接取第一个肯定够大的级别的队首(instant fit),不用逐个比较;
+ * 已分配的段按起始地址散列,释放时O(1)找到.资源不够时可以从source再导入一段(span),整段空闲时还回去 */
+struct vmem {
+   const char* name;
+   uint32_t quantum;                       // 分配单位,2的幂
+   struct vmem* source;                    // 不够时从这里导入,为NULL时不导入
+   uint32_t import_size;                   // 每次至少导入的字节数
+   struct list seglist;                    // 所有的段,按地址排列,每个span以一个span段打头
+   struct list freelist[VMEM_FREELISTS];
+   uint32_t freemap;                       // 第i位为1表示freelist[i]非空
+   struct list hash[VMEM_HASH_SIZE];       // 已分配的段,按起始地址散列
+   struct lock lock;
+   uint32_t total;                         // 各span的总字节数
+   uint32_t in_use;                        // 已分配出去的字节数
+   uint32_t alloc_cnt;                     // 统计用:累计分配次数
+   uint32_t import_cnt;                    // 统计用:累计从source导入的次数
+};
+
+void vmem_create(struct vmem* vm, const char* name, uint32_t base, uint32_t size, uint32_t quantum, \
+   struct vmem* source, uint32_t import_size);
+uint32_t vmem_alloc(struct vmem* vm, uint32_t size);
+uint32_t vmem_xalloc(struct vmem* vm, uint32_t addr, uint32_t size);
+bool vmem_grow(struct vmem* vm, uint32_t addr, uint32_t add);
+bool vmem_split(struct vmem* vm, uint32_t addr, uint32_t keep);
+void vmem_free(struct vmem* vm, uint32_t addr, uint32_t size);
+void vmem_stats(struct vmem* vm);
+#endif
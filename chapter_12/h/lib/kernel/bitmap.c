@@ -8,6 +8,7 @@
 /* 将位图btmp初始化 */
 void bitmap_init(struct bitmap* btmp) {
    memset(btmp->bits, 0, btmp->btmp_bytes_len);   
+   btmp->next_free = 0;
 }
 
 //用来确定位图的某一位是1，还是0。若是1，返回真（返回的值不一定是1）。否则，返回0。传入两个参数，指向位图的指针，与要判断的位的偏移
@@ -17,44 +18,124 @@ bool bitmap_scan_test(struct bitmap* btmp, uint32_t bit_idx) {
    return (btmp->bits[byte_idx] & (BITMAP_MASK << bit_odd));
 }
 
+/* 取出位图中第word_idx个32位字。位图长度不一定是4字节的整数倍，
+ * 超出位图末尾的部分一律按1填充，这样扫描时越界的位会被当作已占用 */
+static uint32_t bitmap_word(struct bitmap* btmp, uint32_t word_idx) {
+   uint32_t byte_idx = word_idx * 4;
+   if (byte_idx + 4 <= btmp->btmp_bytes_len) {
+      return *(uint32_t*)(btmp->bits + byte_idx);    //x86允许非对齐访问，位图起始地址不必4字节对齐
+   }
+   uint32_t word = BITMAP_WORD_FULL, i;
+   for (i = 0; byte_idx + i < btmp->btmp_bytes_len; i++) {
+      word &= ~(0xffu << (i * 8));
+      word |= (uint32_t)btmp->bits[byte_idx + i] << (i * 8);
+   }
+   return word;
+}
+
+/* 返回word中最低的那个1所在的位置，用bsf指令一次得到，调用者保证word不为0 */
+static inline uint32_t word_first_set(uint32_t word) {
+   uint32_t idx;
+   asm ("bsfl %1, %0" : "=r" (idx) : "rm" (word));
+   return idx;
+}
+
+//从第start位开始向后找第一个值为value的位，一次处理一个32位字，全1（找0时）或全0（找1时）的字整字跳过
+//找到就返回该位的下标，找不到就返回位图的总位数
+static uint32_t bitmap_find_next(struct bitmap* btmp, uint32_t start, int8_t value) {
+   uint32_t bits_total = btmp->btmp_bytes_len * 8;
+   if (start >= bits_total) {
+      return bits_total;
+   }
+   uint32_t word_idx = start / 32;
+   uint32_t word = bitmap_word(btmp, word_idx);
+   if (!value) {
+      word = ~word;                             //找0就先把字取反，统一成找1
+   }
+   word &= BITMAP_WORD_FULL << (start % 32);    //屏蔽掉start之前的位
+   while (word == 0) {
+      word_idx++;
+      if (word_idx * 32 >= bits_total) {
+         return bits_total;
+      }
+      word = bitmap_word(btmp, word_idx);
+      if (!value) {
+         word = ~word;
+      }
+   }
+   uint32_t bit_idx = word_idx * 32 + word_first_set(word);
+   return bit_idx < bits_total ? bit_idx : bits_total;   //找1时可能落在末尾填充的1上，要截断
+}
+
 //用来在位图中找到cnt个连续的0，以此来分配一块连续未被占用的内存，参数有指向位图的指针与要分配的内存块的个数cnt
 //成功就返回起始位的偏移（如果把位图看做一个数组，那么也可以叫做下标），不成功就返回-1
-int bitmap_scan(struct bitmap* bitmap, uint32_t cnt){
-    uint32_t area_start = 0, area_size = 0;    //用来存储一个连续为0区域的起始位置, 存储一个连续为0的区域大小
-    while(1){                   
-        while( bitmap_scan_test(bitmap, area_start) && area_start / 8 < bitmap->btmp_bytes_len) //当这个while顺利结束1、area_start就是第一个0的位置；2、area_start已经越过位图边界
-            area_start++;
-        if(area_start / 8 >= bitmap->btmp_bytes_len)    //上面那个循环跑完可能是area_start已经越过边界，说明此时位图中是全1，那么就没有可分配内存
-            return -1;
-        area_size = 1;  //来到了这一句说明找到了位图中第一个0，那么此时area_size自然就是1
-        while( area_size < cnt ){
-            if( (area_start + area_size) / 8 < bitmap->btmp_bytes_len ){    //确保下一个要判断的位不超过边界
-                if( bitmap_scan_test(bitmap, area_start + area_size) == 0 ) //判断区域起始0的下一位是否是0
-                    area_size++;
-                else
-                    break;  //进入else，说明下一位是1，此时area_size还没有到达cnt的要求，且一片连续为0的区域截止，break
-            }
-            else
-                return -1;  //来到这里面，说面下一个要判断的位超过边界，且area_size<cnt，返回-1
-        }
-        if(area_size == cnt)    //有两种情况另上面的while结束，1、area_size == cnt；2、break；所以要判断
-            return area_start;
-        area_start += (area_size+1); //更新area_start，判断后面是否有满足条件的连续0区域
-    }
+//从next_free提示处开始，交替地按字找下一个0（区域起点）与下一个1（区域终点），每次跳过一整片区域，而不是逐位测试
+int bitmap_scan(struct bitmap* btmp, uint32_t cnt) {
+   uint32_t bits_total = btmp->btmp_bytes_len * 8;
+   uint32_t area_start = bitmap_find_next(btmp, btmp->next_free, 0);
+   btmp->next_free = area_start;        //area_start之前的位全为1，顺手把提示推到这里，下次不必再扫
+   while (area_start < bits_total) {
+      uint32_t area_end = bitmap_find_next(btmp, area_start, 1);    //这片连续为0区域的结束位置（不含）
+      if (area_end - area_start >= cnt) {
+         return area_start;
+      }
+      area_start = bitmap_find_next(btmp, area_end, 0);            //跳过后面的1，找下一片为0的区域
+   }
+   return -1;
 }
 
-//将位图某一位设定为1或0，传入参数是指向位图的指针与这一位的偏移，与想要的值
-void bitmap_set(struct bitmap* btmp, uint32_t bit_idx, int8_t value) {
-   ASSERT((value == 0) || (value == 1));
+//只写位图中的一位，不维护next_free提示
+static inline void bitmap_write_bit(struct bitmap* btmp, uint32_t bit_idx, int8_t value) {
    uint32_t byte_idx = bit_idx / 8;    //确定要设置的位所在字节的偏移
    uint32_t bit_odd  = bit_idx % 8;    //确定要设置的位在某个字节中的偏移
 
 /* 一般都会用个0x1这样的数对字节中的位操作,
  * 将1任意移动后再取反,或者先取反再移位,可用来对位置0操作。*/
-   if (value) {		      // 如果value为1
+   if (value) {
       btmp->bits[byte_idx] |= (BITMAP_MASK << bit_odd);
-   } else {		      // 若为0
+   } else {
       btmp->bits[byte_idx] &= ~(BITMAP_MASK << bit_odd);
    }
 }
 
+//将位图某一位设定为1或0，传入参数是指向位图的指针与这一位的偏移，与想要的值
+void bitmap_set(struct bitmap* btmp, uint32_t bit_idx, int8_t value) {
+   ASSERT((value == 0) || (value == 1));
+   bitmap_write_bit(btmp, bit_idx, value);
+   if (value) {		      // 如果value为1
+      if (bit_idx == btmp->next_free) {   //提示位被占用了，提示后移一位，仍然保证提示之前全为1
+         btmp->next_free++;
+      }
+   } else {		      // 若为0
+      if (bit_idx < btmp->next_free) {    //释放的位在提示之前，提示要回退到这里
+         btmp->next_free = bit_idx;
+      }
+   }
+}
+
+//将位图中从bit_idx开始的连续cnt位都设为value，首尾不满一个字的部分逐位写，中间的部分整字写入
+void bitmap_set_range(struct bitmap* btmp, uint32_t bit_idx, uint32_t cnt, int8_t value) {
+   ASSERT((value == 0) || (value == 1));
+   uint32_t start = bit_idx, end = bit_idx + cnt;
+   ASSERT(end <= btmp->btmp_bytes_len * 8);
+   while (bit_idx < end && bit_idx % 32 != 0) {
+      bitmap_write_bit(btmp, bit_idx++, value);
+   }
+   uint32_t word = value ? BITMAP_WORD_FULL : 0;
+   while (bit_idx + 32 <= end) {
+      *(uint32_t*)(btmp->bits + bit_idx / 8) = word;
+      bit_idx += 32;
+   }
+   while (bit_idx < end) {
+      bitmap_write_bit(btmp, bit_idx++, value);
+   }
+
+   if (value) {
+      if (start <= btmp->next_free && btmp->next_free < end) {   //提示落在刚占用的区域里，end之前就全为1了
+         btmp->next_free = end;
+      }
+   } else if (start < btmp->next_free) {
+      btmp->next_free = start;
+   }
+}
+
@@ -2,13 +2,16 @@
 #define __LIB_KERNEL_BITMAP_H
 #include "global.h"
 #define BITMAP_MASK 1
+#define BITMAP_WORD_FULL 0xffffffff   //一个32位字的所有位都为1，说明这个字对应的32个单位都已占用，扫描时可以整字跳过
 struct bitmap {                 //这个数据结构就是用来管理整个位图
    uint32_t btmp_bytes_len;     //记录整个位图的大小，字节为单位
    uint8_t* bits;               //用来记录位图的起始地址，我们未来用这个地址遍历位图时，操作单位指定为最小的字节
+   uint32_t next_free;          //第一个可能为0的位的下标提示，保证比它小的位全部为1，bitmap_scan从这里开始找，由bitmap_set维护
 };
 
 void bitmap_init(struct bitmap* btmp);
 bool bitmap_scan_test(struct bitmap* btmp, uint32_t bit_idx);
 int bitmap_scan(struct bitmap* btmp, uint32_t cnt);
 void bitmap_set(struct bitmap* btmp, uint32_t bit_idx, int8_t value);
+void bitmap_set_range(struct bitmap* btmp, uint32_t bit_idx, uint32_t cnt, int8_t value);
 #endif
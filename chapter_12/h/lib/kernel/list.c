@@ -7,6 +7,9 @@ void list_init (struct list* list) {
    list->head.next = &list->tail;
    list->tail.prev = &list->head;
    list->tail.next = NULL;
+#if DEBUG_LEVEL >= 1
+   list->head.owner = list->tail.owner = list;     // 队首队尾的标签指向链表自己,插入的结点从before那里继承标签
+#endif
 }
 
 /* 把链表元素elem插入在元素before之前 */
@@ -23,6 +26,9 @@ void list_insert_before(struct list_elem* before, struct list_elem* elem) {
 
 /* 更新before的前驱结点为elem */
    before->prev = elem;
+#if DEBUG_LEVEL >= 1
+   elem->owner = before->owner;
+#endif
 
    intr_set_status(old_status);     //关中断之前是开着，那么现在就重新打开中断，如果关着，那么就继续关着
 }
@@ -43,6 +49,9 @@ void list_remove(struct list_elem* pelem) {
    
    pelem->prev->next = pelem->next;
    pelem->next->prev = pelem->prev;
+#if DEBUG_LEVEL >= 1
+   pelem->owner = NULL;
+#endif
 
    intr_set_status(old_status);
 }
@@ -66,6 +75,22 @@ bool elem_find(struct list* plist, struct list_elem* obj_elem) {
    	return false;
 }
 
+/* 判断obj_elem是否在链表plist中,用于各处的断言。
+ * 级别1以上直接比较结点的owner标签,O(1);级别0没有标签,只能退回elem_find遍历 */
+bool elem_in_list(struct list* plist, struct list_elem* obj_elem) {
+#if DEBUG_LEVEL >= 1
+   bool found = (obj_elem->owner == plist);
+#if DEBUG_LEVEL >= 2
+   if (found != elem_find(plist, obj_elem)) {
+      PANIC("elem_in_list: owner tag out of sync with list");
+   }
+#endif
+   return found;
+#else
+   return elem_find(plist, obj_elem);
+#endif
+}
+
 /* 把列表plist中的每个元素elem和arg传给回调函数func,
  * arg给func用来判断elem是否符合条件.
  * 本函数的功能是遍历列表内所有元素,逐个判断是否有符合条件的元素。
@@ -1,6 +1,7 @@
 #ifndef __LIB_KERNEL_LIST_H
 #define __LIB_KERNEL_LIST_H
 #include "global.h"
+#include "debug.h"
 
 //用于计算一个结构体成员在结构体中的偏移量
 #define offset(struct_type,member) (int)(&((struct_type*)0)->member)
@@ -14,6 +15,9 @@
 struct list_elem {
    struct list_elem* prev; // 前躯结点
    struct list_elem* next; // 后继结点
+#if DEBUG_LEVEL >= 1
+   struct list* owner;     // 结点当前所在的链表,不在任何链表中时为NULL,用来O(1)地判断结点是否在某链表中
+#endif
 };
 
 /* 链表结构,用来管理整个队列 */
@@ -38,4 +42,5 @@ bool list_empty(struct list* plist);
 uint32_t list_len(struct list* plist);
 struct list_elem* list_traversal(struct list* plist, function func, int arg);
 bool elem_find(struct list* plist, struct list_elem* obj_elem);
+bool elem_in_list(struct list* plist, struct list_elem* obj_elem);
 #endif
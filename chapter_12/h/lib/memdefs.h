@@ -0,0 +1,31 @@
+#ifndef __LIB_MEMDEFS_H
+#define __LIB_MEMDEFS_H
+#include "stdint.h"
+/* 内核与用户程序共用的内存定义:用户地址空间的布局和meminfo系统调用返回的结构.
+ * lib/user下的代码只需要这些,不必包含内核的thread.h、process.h、memory.h */
+
+#define USER_STACK3_VADDR  (0xc0000000 - 0x1000)    //定义了一页C语言程序的栈顶起始地址（虚拟）,书p511
+#define USER_STACK_SIZE  0x800000    //用户3级栈在缺页时按需向下增长,最多8MB
+#define USER_STACK_BOTTOM (USER_STACK3_VADDR + 0x1000 - USER_STACK_SIZE)  //用户栈能增长到的最低地址
+#define USER_HEAP_VADDR (USER_STACK_BOTTOM - 0x1000)  //用户态malloc的状态页,每个进程都在这个固定地址,紧挨在用户栈能增长到的范围之下
+
+/* 内核或用户进程这一方的物理页框账目,sys_meminfo用 */
+struct pool_info {
+   uint32_t used_pages;    // 当前占用的页框数
+   uint32_t min_pages;     // 保底,对方不能把空闲页框用到少于这一方还没用满的保底
+   uint32_t max_pages;     // 上限
+   uint32_t peak_pages;    // 占用的最高值
+   uint32_t fail_cnt;      // 因为上限或对方的保底而申请失败的次数
+};
+
+/* 物理内存的使用情况 */
+struct meminfo {
+   uint32_t total_pages;      // 可分配的页框总数
+   uint32_t free_pages;       // 伙伴系统中空闲的页框数
+   uint32_t zeroed_pages;     // 清零页框池中的页框数,也算空闲
+   uint32_t page_tables;      // 用户页表占用的页框数,记在内核的账上
+   struct pool_info kernel;
+   struct pool_info user;
+};
+
+#endif
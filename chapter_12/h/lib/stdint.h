@@ -8,4 +8,5 @@ typedef unsigned char uint8_t;
 typedef unsigned short int uint16_t;
 typedef unsigned int uint32_t;
 typedef unsigned long long int uint64_t;
+typedef uint16_t pid_t;
 #endif
@@ -64,7 +64,8 @@ uint32_t vsprintf(char* str, const char* format, va_list ap) {
 			break;
 		}
 	}
-	return strlen(str);
+	*buf_ptr = '\0';			// 调用者的buf不一定清过0,要自己补上结尾
+	return buf_ptr - str;
 }
 
 /* 格式化输出字符串format */
@@ -76,3 +77,13 @@ uint32_t printf(const char* format, ...) {
    va_end(args);
    return write(buf); 
 }
+
+/* 同printf不同的是字符串不是写到终端,而是写到buf中 */
+uint32_t sprintf(char* buf, const char* format, ...) {
+   va_list args;
+   uint32_t retval;
+   va_start(args, format);
+   retval = vsprintf(buf, format, args);
+   va_end(args);
+   return retval;
+}
@@ -2,29 +2,86 @@
 #include "global.h"
 #include "debug.h"  //定义了ASSERT
 
+#define CPUID_ERMS (1 << 9)     // cpuid 7号功能ebx中的ERMS位,支持增强的rep movsb/stosb
+
+/* cpu是否支持ERMS,由string_init在启动时探测一次.
+ * 支持时逐字节的rep movsb/stosb由硬件按最宽的方式搬运,比按双字rep movsd/stosd再补尾巴还快;
+ * 不用sse:线程切换不保存xmm寄存器,用户进程也调用这些函数,没法在里面关中断 */
+static bool cpu_erms = false;
+
+/* 根据cpuid选定memset与memcpy的实现,在init_all最开始调用 */
+void string_init(void) {
+    uint32_t max_leaf, ebx, ecx = 0, edx;
+    asm volatile ("cpuid" : "=a" (max_leaf), "=b" (ebx), "=c" (ecx), "=d" (edx) : "a" (0));
+    if (max_leaf >= 7) {
+        ecx = 0;
+        asm volatile ("cpuid" : "=a" (max_leaf), "=b" (ebx), "+c" (ecx), "=d" (edx) : "a" (7));
+        cpu_erms = (ebx & CPUID_ERMS) != 0;
+    }
+}
+
 //将dst起始的size个字节置为value，这个函数最常用的用法就是来初始化一块内存区域，也就是置为ASCII码为0
+//先按双字rep stosl,再用rep stosb补上不足4字节的尾巴;cpu支持ERMS时直接rep stosb
 void memset(void* dst_, uint8_t value, uint32_t size) {
     ASSERT(dst_ != NULL);            //一般开发都有这个习惯，传入进来个地址，判断不是空
-    uint8_t* dst = (uint8_t*)dst_;   //强制类型转换，将对地址的操作单位变成一字节
-    while (size-- > 0)               //先判断size是否>0，然后再减，然后执行循环体，size是多少，就会循环多少次
-        *dst++ = value;               //*的优先级高于++，所以是先对dst指向的地址进行操作(*dst=value)，然后地址+1
+    if (cpu_erms) {
+        asm volatile ("cld; rep stosb" : "+D" (dst_), "+c" (size) : "a" (value) : "memory");
+        return;
+    }
+    uint32_t dwords = size >> 2;
+    uint32_t pattern = value * 0x01010101;   // 把value复制到双字的每个字节,低字节仍是value,正好给rep stosb用
+    asm volatile ("cld; rep stosl; movl %3, %%ecx; rep stosb" \
+                  : "+D" (dst_), "+c" (dwords) : "a" (pattern), "r" (size & 3) : "memory");
 }
 
-//将src地址起始处size字节的数据移入dst，用于拷贝内存数据
+//将src地址起始处size字节的数据移入dst，用于拷贝内存数据,两块内存不能重叠,重叠时用memmove
 //src起始是有数据的，所以用const void*，const修饰void*，意味着地址内的数据是只读
 void memcpy(void* dst_, const void* src_, uint32_t size) {
+    ASSERT(dst_ != NULL && src_ != NULL);
+    if (cpu_erms) {
+        asm volatile ("cld; rep movsb" : "+D" (dst_), "+S" (src_), "+c" (size) : : "memory");
+        return;
+    }
+    uint32_t dwords = size >> 2;
+    asm volatile ("cld; rep movsl; movl %3, %%ecx; rep movsb" \
+                  : "+D" (dst_), "+S" (src_), "+c" (dwords) : "r" (size & 3) : "memory");
+}
+
+//同memcpy,但允许两块内存重叠.dst在src后面且有重叠时要从后往前拷贝,
+//不用std反向rep movs,免得拷贝中途来了中断,处理程序带着DF=1运行
+void memmove(void* dst_, const void* src_, uint32_t size) {
     ASSERT(dst_ != NULL && src_ != NULL);
     uint8_t* dst = dst_;
     const uint8_t* src = src_;
-    while (size-- > 0)
-        *dst++ = *src++;
+    if (dst <= src || dst >= src + size) {
+        memcpy(dst_, src_, size);
+        return;
+    }
+    dst += size;
+    src += size;
+    while (size & 3) {
+        *--dst = *--src;
+        size--;
+    }
+    while (size > 0) {
+        dst -= 4;
+        src -= 4;
+        *(uint32_t*)dst = *(const uint32_t*)src;
+        size -= 4;
+    }
 }
 
 //比较两个地址起始的size字节的数据是否相等，如果相等，则返回0；如果不相等，比较第一个不相等的数据，>返回1，<返回-1
+//先按双字跳过相等的部分,再在第一个不相等的双字里逐字节找
 int memcmp(const void* a_, const void* b_, uint32_t size) {
     const char* a = a_;
     const char* b = b_;
     ASSERT(a != NULL || b != NULL);
+    while (size >= 4 && *(const uint32_t*)a == *(const uint32_t*)b) {
+        a += 4;
+        b += 4;
+        size -= 4;
+    }
     while (size-- > 0) {
         if(*a != *b) {
 	        return *a > *b ? 1 : -1; 
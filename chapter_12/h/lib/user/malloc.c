@@ -0,0 +1,296 @@
+#include "malloc.h"
+#include "stdint.h"
+#include "global.h"
+#include "syscall.h"
+#include "memdefs.h"
+#include "string.h"
+
+/* 用户态的内存分配器:小内存块在用户态从本进程的arena中分配和回收,不用陷入内核;
+ * 只有arena用完了才用mmap一次要HEAP_CHUNK_PAGES页,大于1024字节的申请直接mmap整页 */
+
+static struct heap* const heap = (struct heap*)USER_HEAP_VADDR;
+
+/* 空闲的小内存块,开头存放arena内空闲块单链表的后继指针 */
+struct heap_block {
+   struct heap_block* next;
+};
+
+/* 小内存块的arena,占一页,页开头是这个头 */
+struct heap_arena {
+   struct heap_arena* prev;         // 在partial链表中的前驱
+   struct heap_arena* next;         // 在partial链表中的后继
+   uint16_t class_idx;              // 所属规格
+   uint16_t chunk_idx;              // 所在整块在heap->chunks中的下标
+   uint16_t free_cnt;               // 空闲块数
+   uint16_t carved;                 // 已经切出过的块数,后面的块还没有用过
+   struct heap_block* free_head;    // 切出后又被释放的块组成的单链表
+};
+
+/* 大块描述符,从16字节的小内存块中分配,元信息不放在大块里,大块的地址才能页对齐 */
+struct heap_large {
+   struct heap_large* next;
+   uint32_t vaddr;
+   uint32_t pg_cnt;
+};
+
+static const uint16_t class_sizes[HEAP_CLASS_CNT] = {16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024};
+
+/* 能容纳size字节的最小规格 */
+static uint32_t size_to_class(uint32_t size) {
+   uint32_t class_idx = 0;
+   while (class_sizes[class_idx] < size) {
+      class_idx++;
+   }
+   return class_idx;
+}
+
+/* 从整块中取一页给arena,优先从已经在用的整块中取,让完全空闲的整块有机会还给内核.
+ * 都没有空页时再mmap一个新的整块,失败返回0 */
+static uint32_t chunk_page_get(uint32_t* chunk_idx) {
+   int32_t pick = -1, unused = -1;
+   uint32_t idx;
+   for (idx = 0; idx < HEAP_CHUNK_CNT; idx++) {
+      struct heap_chunk* chunk = &heap->chunks[idx];
+      if (chunk->base == 0) {
+         if (unused == -1) {
+            unused = idx;
+         }
+      }
+      else if (chunk->free_map != 0) {
+         pick = idx;
+         if (chunk->used != 0) {
+            break;
+         }
+      }
+   }
+   if (pick == -1) {
+      if (unused == -1) {
+         return 0;
+      }
+      uint32_t base = (uint32_t)mmap(NULL, HEAP_CHUNK_PAGES);
+      if (base == 0) {
+         return 0;
+      }
+      pick = unused;
+      heap->chunks[pick].base = base;
+      heap->chunks[pick].free_map = (1 << HEAP_CHUNK_PAGES) - 1;
+      heap->chunks[pick].used = 0;
+      heap->empty_chunks++;
+   }
+
+   struct heap_chunk* chunk = &heap->chunks[pick];
+   uint32_t page_idx = 0;
+   while (!(chunk->free_map & (1 << page_idx))) {
+      page_idx++;
+   }
+   chunk->free_map &= ~(1 << page_idx);
+   if (chunk->used++ == 0) {
+      heap->empty_chunks--;
+   }
+   *chunk_idx = pick;
+   return chunk->base + page_idx * PG_SIZE;
+}
+
+/* 把arena占的页还给所在整块,整块完全空闲而留着的已经够数时,把整块还给内核 */
+static void chunk_page_put(struct heap_arena* a) {
+   struct heap_chunk* chunk = &heap->chunks[a->chunk_idx];
+   chunk->free_map |= 1 << (((uint32_t)a - chunk->base) / PG_SIZE);
+   if (--chunk->used == 0) {
+      if (heap->empty_chunks < HEAP_CHUNK_KEEP) {
+         heap->empty_chunks++;
+      }
+      else {
+         munmap((void*)chunk->base, HEAP_CHUNK_PAGES);
+         chunk->base = 0;
+      }
+   }
+}
+
+/* 把arena挂到所属规格的partial链表头 */
+static void partial_link(struct heap_arena* a) {
+   struct heap_arena** head = &heap->partial[a->class_idx];
+   a->prev = NULL;
+   a->next = *head;
+   if (*head != NULL) {
+      (*head)->prev = a;
+   }
+   *head = a;
+}
+
+/* 把arena从所属规格的partial链表上摘下 */
+static void partial_unlink(struct heap_arena* a) {
+   if (a->prev != NULL) {
+      a->prev->next = a->next;
+   }
+   else {
+      heap->partial[a->class_idx] = a->next;
+   }
+   if (a->next != NULL) {
+      a->next->prev = a->prev;
+   }
+}
+
+/* 每个arena能容纳的规格为class_idx的内存块数 */
+static uint32_t blocks_per_arena(uint32_t class_idx) {
+   return (PG_SIZE - sizeof(struct heap_arena)) / class_sizes[class_idx];
+}
+
+/* 分配一个规格为class_idx的小内存块,失败返回NULL */
+static void* block_alloc(uint32_t class_idx) {
+   struct heap_arena* a = heap->partial[class_idx];
+   if (a == NULL) {
+      uint32_t chunk_idx;
+      a = (struct heap_arena*)chunk_page_get(&chunk_idx);
+      if (a == NULL) {
+         return NULL;
+      }
+      a->class_idx = class_idx;
+      a->chunk_idx = chunk_idx;
+      a->free_cnt = blocks_per_arena(class_idx);
+      a->carved = 0;
+      a->free_head = NULL;
+      partial_link(a);
+   }
+
+   struct heap_block* b = a->free_head;
+   if (b != NULL) {
+      a->free_head = b->next;
+   }
+   else {
+      b = (struct heap_block*)((uint32_t)(a + 1) + a->carved++ * class_sizes[class_idx]);
+   }
+   if (--a->free_cnt == 0) {
+      partial_unlink(a);
+   }
+   return b;
+}
+
+/* 把小内存块b还回所在arena,arena全部空闲时把页还给整块 */
+static void block_free(struct heap_block* b) {
+   struct heap_arena* a = (struct heap_arena*)((uint32_t)b & 0xfffff000);
+   b->next = a->free_head;
+   a->free_head = b;
+   if (a->free_cnt++ == 0) {
+      partial_link(a);
+   }
+   if (a->free_cnt == blocks_per_arena(a->class_idx)) {
+      partial_unlink(a);
+      chunk_page_put(a);
+   }
+}
+
+/* 返回指向起始地址为vaddr的大块描述符的那个指针,没有这个大块时它指向NULL */
+static struct heap_large** large_link(uint32_t vaddr) {
+   struct heap_large** link = &heap->large[(vaddr / PG_SIZE) % HEAP_LARGE_HASH];
+   while (*link != NULL && (*link)->vaddr != vaddr) {
+      link = &(*link)->next;
+   }
+   return link;
+}
+
+/* 在用户堆中申请size字节内存,内容不清0.超过1024字节的按整页分配,返回页对齐的地址 */
+void* malloc(uint32_t size) {
+   if (size == 0) {
+      return NULL;
+   }
+   if (size <= class_sizes[HEAP_CLASS_CNT - 1]) {
+      return block_alloc(size_to_class(size));
+   }
+
+   uint32_t pg_cnt = DIV_ROUND_UP(size, PG_SIZE);
+   struct heap_large* ld = block_alloc(size_to_class(sizeof(struct heap_large)));
+   if (ld == NULL) {
+      return NULL;
+   }
+   void* vaddr = mmap(NULL, pg_cnt);
+   if (vaddr == NULL) {
+      block_free((struct heap_block*)ld);
+      return NULL;
+   }
+   struct heap_large** bucket = &heap->large[((uint32_t)vaddr / PG_SIZE) % HEAP_LARGE_HASH];
+   ld->vaddr = (uint32_t)vaddr;
+   ld->pg_cnt = pg_cnt;
+   ld->next = *bucket;
+   *bucket = ld;
+   return vaddr;
+}
+
+/* 释放malloc得到的内存ptr,小内存块前面总有arena头,不会页对齐,页对齐的只能是大块 */
+void free(void* ptr) {
+   if (ptr == NULL) {
+      return;
+   }
+   if ((uint32_t)ptr % PG_SIZE != 0) {
+      block_free(ptr);
+      return;
+   }
+
+   struct heap_large** link = large_link((uint32_t)ptr);
+   struct heap_large* ld = *link;
+   if (ld == NULL) {      // 不是malloc给出的地址
+      return;
+   }
+   *link = ld->next;
+   munmap(ptr, ld->pg_cnt);
+   block_free((struct heap_block*)ld);
+}
+
+/* 把ptr指向的内存调整为size字节,返回调整后的地址,内容保留新旧大小中较小的那部分,失败时返回NULL且ptr不变.
+ * 小内存块在原规格还放得下时原地不动;大块缩小时归还尾部的页,扩大时先试着mmap紧接着的地址原地扩展,
+ * 都不行才另行分配并复制 */
+void* realloc(void* ptr, uint32_t size) {
+   if (ptr == NULL) {
+      return malloc(size);
+   }
+   if (size == 0) {
+      free(ptr);
+      return NULL;
+   }
+   uint32_t old_size;
+   if ((uint32_t)ptr % PG_SIZE != 0) {
+      struct heap_arena* a = (struct heap_arena*)((uint32_t)ptr & 0xfffff000);
+      old_size = class_sizes[a->class_idx];
+      if (size <= old_size) {
+         return ptr;
+      }
+   }
+   else {
+      struct heap_large* ld = *large_link((uint32_t)ptr);
+      if (ld == NULL) {      // 不是malloc给出的地址
+         return NULL;
+      }
+      uint32_t new_pg = DIV_ROUND_UP(size, PG_SIZE);
+      old_size = ld->pg_cnt * PG_SIZE;
+      if (new_pg < ld->pg_cnt) {
+         munmap((void*)((uint32_t)ptr + new_pg * PG_SIZE), ld->pg_cnt - new_pg);
+         ld->pg_cnt = new_pg;
+      }
+      if (new_pg <= ld->pg_cnt) {
+         return ptr;
+      }
+      if (mmap((void*)((uint32_t)ptr + old_size), new_pg - ld->pg_cnt) != NULL) {
+         ld->pg_cnt = new_pg;
+         return ptr;
+      }
+   }
+
+   void* new_ptr = malloc(size);
+   if (new_ptr != NULL) {
+      memcpy(new_ptr, ptr, old_size);
+      free(ptr);
+   }
+   return new_ptr;
+}
+
+/* 申请cnt个size字节的元素并清0.大块是刚mmap来的,第一次访问时由内核分配清0的页框,不必再清一遍 */
+void* calloc(uint32_t cnt, uint32_t size) {
+   if (size != 0 && cnt > 0xffffffff / size) {
+      return NULL;
+   }
+   uint32_t total = cnt * size;
+   void* ptr = malloc(total);
+   if (ptr != NULL && total <= class_sizes[HEAP_CLASS_CNT - 1]) {
+      memset(ptr, 0, total);
+   }
+   return ptr;
+}
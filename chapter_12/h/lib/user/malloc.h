@@ -0,0 +1,35 @@
+#ifndef __LIB_USER_MALLOC_H
+#define __LIB_USER_MALLOC_H
+#include "stdint.h"
+
+#define HEAP_CLASS_CNT 12      // 小内存块的规格数,与内核的16、32...1024这12种相同
+#define HEAP_CHUNK_PAGES 16    // 一次用mmap向内核要的页数,小内存块的arena都从这样的整块中切页
+#define HEAP_CHUNK_CNT 128     // 同时持有的整块数上限
+#define HEAP_CHUNK_KEEP 1      // 完全空闲的整块最多留几个不还给内核,免得在分界处反复mmap、munmap
+#define HEAP_LARGE_HASH 16     // 大块描述符散列表的桶数
+
+struct heap_arena;
+struct heap_large;
+
+/* 向内核要来的一个整块,free_map第i位为1表示第i页空闲 */
+struct heap_chunk {
+   uint32_t base;           // 起始地址,0表示这一项没有用
+   uint16_t free_map;
+   uint16_t used;           // 已经切给arena的页数
+};
+
+/* 用户态堆的全部状态,放在每个进程固定的USER_HEAP_VADDR这一页中.
+ * 用户程序的代码和全局变量都在内核映像里,为所有进程共享,状态不能放在全局变量中;
+ * 这一页由内核在创建进程时登记,第一次访问时才分配并清0,全0正是空堆的状态,fork时随地址空间写时复制 */
+struct heap {
+   struct heap_arena* partial[HEAP_CLASS_CNT];      // 各规格还有空闲块的arena组成的双向链表
+   struct heap_large* large[HEAP_LARGE_HASH];       // 大块描述符,按起始页散列
+   struct heap_chunk chunks[HEAP_CHUNK_CNT];
+   uint32_t empty_chunks;                           // 完全空闲而留着的整块数
+};
+
+void* malloc(uint32_t size);
+void free(void* ptr);
+void* realloc(void* ptr, uint32_t size);
+void* calloc(uint32_t cnt, uint32_t size);
+#endif
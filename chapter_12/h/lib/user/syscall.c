@@ -58,12 +58,33 @@ uint32_t write(char* str) {
    return _syscall1(SYS_WRITE, str);
 }
 
-/* 申请size字节大小的内存,并返回结果 */
-void* malloc(uint32_t size) {
-   return (void*)_syscall1(SYS_MALLOC, size);
+/* 派生子进程,返回子进程pid */
+pid_t fork(void) {
+   return _syscall0(SYS_FORK);
 }
 
-/* 释放ptr指向的内存 */
-void free(void* ptr) {
-   _syscall1(SYS_FREE, ptr);
+/* 睡眠m_seconds毫秒 */
+void sleep(uint32_t m_seconds) {
+   _syscall1(SYS_SLEEP, m_seconds);
+}
+
+/* 获取物理内存的使用情况 */
+void meminfo(struct meminfo* info) {
+   _syscall1(SYS_MEMINFO, info);
+}
+
+/* 结束当前进程 */
+void exit(void) {
+   _syscall0(SYS_EXIT);
+}
+
+/* 预留pg_cnt页连续的用户地址,vaddr不为NULL时只在以它起始的这段地址空闲时占下它,
+ * 返回页对齐的起始地址,失败返回NULL */
+void* mmap(void* vaddr, uint32_t pg_cnt) {
+   return (void*)_syscall2(SYS_MMAP, vaddr, pg_cnt);
+}
+
+/* 归还mmap得到的以vaddr起始的pg_cnt页,成功返回0,失败返回-1 */
+int32_t munmap(void* vaddr, uint32_t pg_cnt) {
+   return _syscall2(SYS_MUNMAP, vaddr, pg_cnt);
 }
@@ -1,15 +1,26 @@
 #ifndef __LIB_USER_SYSCALL_H
 #define __LIB_USER_SYSCALL_H
 #include "stdint.h"
+#include "memdefs.h"
 enum SYSCALL_NR {
    SYS_GETPID,
    SYS_WRITE,
    SYS_MALLOC,
-   SYS_FREE
+   SYS_FREE,
+   SYS_SLEEP,
+   SYS_FORK,
+   SYS_MEMINFO,
+   SYS_EXIT,
+   SYS_MMAP,
+   SYS_MUNMAP
 };
 uint32_t getpid(void);
 uint32_t write(char* str);
-void* malloc(uint32_t size);
-void free(void* ptr);
+void sleep(uint32_t m_seconds);
+pid_t fork(void);
+void meminfo(struct meminfo* info);
+void exit(void);
+void* mmap(void* vaddr, uint32_t pg_cnt);
+int32_t munmap(void* vaddr, uint32_t pg_cnt);
 #endif
 
@@ -0,0 +1,162 @@
+/* 宿主机上运行的bitmap测试,见makefile的host_test目标.
+ * 1 随机位图上把bitmap_scan与改写前逐位测试的扫描对拍,bitmap_set_range与逐位设置的影子数组对拍
+ * 2 用rdtsc测两种扫描各自每次调用的周期数 */
+#include "bitmap.h"
+#include "string.h"
+#include <stdio.h>     // 放在内核头文件后面,stddef.h会先#undef掉global.h中的NULL再定义
+
+/* 内核的ASSERT失败时调用,宿主机上打印出来后直接停下 */
+void panic_spin(char* filename, int line, const char* func, const char* condition) {
+   printf("%s:%d %s: ASSERT(%s) failed\n", filename, line, func, condition);
+   fflush(stdout);
+   __builtin_trap();
+}
+
+static uint32_t rand_state = 2463534242u;
+
+/* xorshift32伪随机数,不用libc的rand,每次运行的结果都一样 */
+static uint32_t rand32(void) {
+   rand_state ^= rand_state << 13;
+   rand_state ^= rand_state >> 17;
+   rand_state ^= rand_state << 5;
+   return rand_state;
+}
+
+static inline uint64_t rdtsc(void) {
+   uint32_t lo, hi;
+   asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+   return ((uint64_t)hi << 32) | lo;
+}
+
+/* 改写前的bitmap_scan:每次都从第0位开始,逐位调用bitmap_scan_test */
+static int old_bitmap_scan(struct bitmap* btmp, uint32_t cnt) {
+   uint32_t area_start = 0, area_size = 0;
+   while (1) {
+      while (bitmap_scan_test(btmp, area_start) && area_start / 8 < btmp->btmp_bytes_len)
+         area_start++;
+      if (area_start / 8 >= btmp->btmp_bytes_len)
+         return -1;
+      area_size = 1;
+      while (area_size < cnt) {
+         if ((area_start + area_size) / 8 < btmp->btmp_bytes_len) {
+            if (bitmap_scan_test(btmp, area_start + area_size) == 0)
+               area_size++;
+            else
+               break;
+         }
+         else
+            return -1;
+      }
+      if (area_size == cnt)
+         return area_start;
+      area_start += (area_size + 1);
+   }
+}
+
+#define MAX_BYTES 67
+
+/* 随机长度、随机起始对齐、随机填充密度的位图上交替做扫描与区间设置,每一步都与参照结果比较 */
+static int check_scan(void) {
+   uint8_t buf[MAX_BYTES + 3], shadow[MAX_BYTES];
+   uint32_t round, step, i;
+   for (round = 0; round < 100000; round++) {
+      struct bitmap btmp;
+      btmp.bits = buf + rand32() % 4;          // 位图起始地址不一定4字节对齐
+      btmp.btmp_bytes_len = 1 + rand32() % MAX_BYTES;
+      bitmap_init(&btmp);
+      uint32_t bits_total = btmp.btmp_bytes_len * 8;
+      uint32_t density = rand32() % 100;
+      for (i = 0; i < bits_total; i++) {
+         if (rand32() % 100 < density) {
+            bitmap_set(&btmp, i, 1);
+         }
+      }
+      memcpy(shadow, btmp.bits, btmp.btmp_bytes_len);
+
+      for (step = 0; step < 16; step++) {
+         uint32_t cnt = 1 + rand32() % 48;
+         int got = bitmap_scan(&btmp, cnt), want = old_bitmap_scan(&btmp, cnt);
+         if (got != want) {
+            printf("bitmap_scan: len %d cnt %d got %d want %d\n", btmp.btmp_bytes_len, cnt, got, want);
+            return -1;
+         }
+         uint32_t start = got, value = 1;
+         if (got < 0 || rand32() % 2) {        // 一半时候占用找到的区域,其余时候随机设置一段
+            start = rand32() % bits_total;
+            cnt = 1 + rand32() % (bits_total - start);
+            value = rand32() % 2;
+         }
+         bitmap_set_range(&btmp, start, cnt, value);
+         for (i = start; i < start + cnt; i++) {
+            if (value) {
+               shadow[i / 8] |= 1 << (i % 8);
+            } else {
+               shadow[i / 8] &= ~(1 << (i % 8));
+            }
+         }
+         if (memcmp(shadow, btmp.bits, btmp.btmp_bytes_len) != 0) {
+            printf("bitmap_set_range: len %d start %d cnt %d value %d differs\n", btmp.btmp_bytes_len, start, cnt, value);
+            return -1;
+         }
+         for (i = 0; i < btmp.next_free && i < bits_total; i++) {
+            if (!bitmap_scan_test(&btmp, i)) {
+               printf("next_free %d but bit %d is 0\n", btmp.next_free, i);
+               return -1;
+            }
+         }
+      }
+   }
+   printf("bitmap: scan and set_range match the reference on 100000 random bitmaps\n");
+   return 0;
+}
+
+#define BENCH_BYTES 4096      // 32768位,相当于128MB内存的页框位图
+#define BENCH_CALLS 2000
+
+static uint8_t bench_bits[BENCH_BYTES];
+
+/* 测一次扫描的平均周期数,scan是bitmap_scan或old_bitmap_scan */
+static uint32_t bench_scan(struct bitmap* btmp, int (*scan)(struct bitmap*, uint32_t), uint32_t cnt) {
+   uint32_t i;
+   uint64_t start = rdtsc();
+   for (i = 0; i < BENCH_CALLS; i++) {
+      scan(btmp, cnt);
+   }
+   return (uint32_t)((rdtsc() - start) / BENCH_CALLS);
+}
+
+/* 两种典型的状态:前90%已占满,后面全空(单页分配的常态);整个位图一半随机占用(碎片化) */
+static void bench(void) {
+   struct bitmap btmp;
+   uint32_t i, cnt;
+   btmp.bits = bench_bits;
+   btmp.btmp_bytes_len = BENCH_BYTES;
+
+   bitmap_init(&btmp);
+   bitmap_set_range(&btmp, 0, BENCH_BYTES * 8 / 10 * 9, 1);
+   printf("90%% full prefix   cnt  old cycles  new cycles\n");
+   for (cnt = 1; cnt <= 64; cnt *= 8) {
+      printf("                  %3d  %10d  %10d\n", cnt,
+             bench_scan(&btmp, old_bitmap_scan, cnt), bench_scan(&btmp, bitmap_scan, cnt));
+   }
+
+   bitmap_init(&btmp);
+   for (i = 0; i < BENCH_BYTES * 8; i++) {
+      if (rand32() % 2) {
+         bitmap_set(&btmp, i, 1);
+      }
+   }
+   printf("50%% random        cnt  old cycles  new cycles\n");
+   for (cnt = 1; cnt <= 64; cnt *= 8) {
+      printf("                  %3d  %10d  %10d\n", cnt,
+             bench_scan(&btmp, old_bitmap_scan, cnt), bench_scan(&btmp, bitmap_scan, cnt));
+   }
+}
+
+int main(void) {
+   if (check_scan() != 0) {
+      return 1;
+   }
+   bench();
+   return 0;
+}
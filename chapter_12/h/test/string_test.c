@@ -0,0 +1,185 @@
+/* 宿主机上运行的lib/string.c测试,见makefile的host_test目标.
+ * 1 memset/memcpy/memmove/memcmp在各种起始对齐和长度下与改写前逐字节的实现对拍,memmove还要测两个方向的重叠
+ * 2 用rdtsc测改写前后的memset/memcpy每个周期处理的字节数
+ * 直接包含string.c,这样能改写cpu_erms,不管宿主机支不支持ERMS,两种实现都测到 */
+#include "string.c"
+#include <stdio.h>     // 放在内核头文件后面,stddef.h会先#undef掉global.h中的NULL再定义
+
+/* 内核的ASSERT失败时调用,宿主机上打印出来后直接停下 */
+void panic_spin(char* filename, int line, const char* func, const char* condition) {
+   printf("%s:%d %s: ASSERT(%s) failed\n", filename, line, func, condition);
+   fflush(stdout);
+   __builtin_trap();
+}
+
+static inline uint64_t rdtsc(void) {
+   uint32_t lo, hi;
+   asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+   return ((uint64_t)hi << 32) | lo;
+}
+
+/* 以下三个是改写前的逐字节实现,作为参照 */
+static void old_memset(void* dst_, uint8_t value, uint32_t size) {
+   uint8_t* dst = (uint8_t*)dst_;
+   while (size-- > 0)
+      *dst++ = value;
+}
+
+static void old_memcpy(void* dst_, const void* src_, uint32_t size) {
+   uint8_t* dst = dst_;
+   const uint8_t* src = src_;
+   while (size-- > 0)
+      *dst++ = *src++;
+}
+
+static int old_memcmp(const void* a_, const void* b_, uint32_t size) {
+   const char* a = a_;
+   const char* b = b_;
+   while (size-- > 0) {
+      if (*a != *b) {
+         return *a > *b ? 1 : -1;
+      }
+      a++;
+      b++;
+   }
+   return 0;
+}
+
+/* memmove的参照:先整段拷到临时缓冲区,再拷回去,重叠与否结果都对 */
+static void ref_memmove(void* dst, const void* src, uint32_t size) {
+   static uint8_t tmp[512];
+   old_memcpy(tmp, src, size);
+   old_memcpy(dst, tmp, size);
+}
+
+#define MAX_SIZE 200
+#define BUF_SIZE (MAX_SIZE + 64)
+
+static uint8_t buf_a[BUF_SIZE], buf_b[BUF_SIZE], want[BUF_SIZE];
+
+/* 两个缓冲区填上各不相同的内容,这样多写或少写一个字节都能被发现 */
+static void fill(uint8_t* buf, uint32_t seed) {
+   uint32_t i;
+   for (i = 0; i < BUF_SIZE; i++) {
+      buf[i] = (uint8_t)(i * 7 + seed);
+   }
+}
+
+/* 对齐0到7、长度0到MAX_SIZE的每一种组合,写目的区以外的字节也在比较范围内 */
+static int check_string(void) {
+   uint32_t dst_off, src_off, size;
+   for (dst_off = 0; dst_off < 8; dst_off++) {
+      for (size = 0; size <= MAX_SIZE; size++) {
+         fill(buf_a, 1);
+         fill(want, 1);
+         memset(buf_a + dst_off, 0xa5, size);
+         old_memset(want + dst_off, 0xa5, size);
+         if (old_memcmp(buf_a, want, BUF_SIZE) != 0) {
+            printf("memset: offset %d size %d differs\n", dst_off, size);
+            return -1;
+         }
+         for (src_off = 0; src_off < 8; src_off++) {
+            fill(buf_a, 1);
+            fill(want, 1);
+            fill(buf_b, 3);
+            memcpy(buf_a + dst_off, buf_b + src_off, size);
+            old_memcpy(want + dst_off, buf_b + src_off, size);
+            if (old_memcmp(buf_a, want, BUF_SIZE) != 0) {
+               printf("memcpy: dst offset %d src offset %d size %d differs\n", dst_off, src_off, size);
+               return -1;
+            }
+            /* 同一个缓冲区内移动,dst_off与src_off的大小关系决定重叠的方向 */
+            fill(buf_a, 1);
+            fill(want, 1);
+            memmove(buf_a + dst_off + 32, buf_a + src_off + 32 + size % 5, size);
+            ref_memmove(want + dst_off + 32, want + src_off + 32 + size % 5, size);
+            if (old_memcmp(buf_a, want, BUF_SIZE) != 0) {
+               printf("memmove: dst offset %d src offset %d size %d differs\n", dst_off, src_off + size % 5, size);
+               return -1;
+            }
+            fill(buf_a, 1);
+            fill(want, 1);
+            memmove(buf_a + src_off + 32 + size % 5, buf_a + dst_off + 32, size);
+            ref_memmove(want + src_off + 32 + size % 5, want + dst_off + 32, size);
+            if (old_memcmp(buf_a, want, BUF_SIZE) != 0) {
+               printf("memmove: dst offset %d src offset %d size %d differs\n", src_off + size % 5, dst_off, size);
+               return -1;
+            }
+            /* 相同的内容比较结果为0;再改掉其中一个字节,两个方向比较,结果都要与参照一致 */
+            fill(buf_a, 1);
+            fill(buf_b, 1);
+            if (memcmp(buf_a + dst_off, buf_b + dst_off, size) != 0) {
+               printf("memcmp: offset %d size %d equal data differs\n", dst_off, size);
+               return -1;
+            }
+            if (size > 0) {
+               uint32_t pos = (src_off * 37 + size) % size;
+               buf_b[dst_off + pos] ^= 0x80 >> src_off;
+               if (memcmp(buf_a + dst_off, buf_b + dst_off, size) != old_memcmp(buf_a + dst_off, buf_b + dst_off, size)
+                   || memcmp(buf_b + dst_off, buf_a + dst_off, size) != old_memcmp(buf_b + dst_off, buf_a + dst_off, size)) {
+                  printf("memcmp: offset %d size %d byte %d differs from the reference\n", dst_off, size, pos);
+                  return -1;
+               }
+            }
+         }
+      }
+   }
+   printf("string (%s): memset/memcpy/memmove/memcmp match the reference for offsets 0-7 and sizes 0-%d\n",
+          cpu_erms ? "erms" : "dword", MAX_SIZE);
+   return 0;
+}
+
+#define BENCH_MAX 65536
+
+static uint8_t bench_dst[BENCH_MAX + 8], bench_src[BENCH_MAX + 8];
+
+/* 测每个周期处理的字节数,放大100倍打印成两位小数;目的地址错开off字节,看不对齐时的情况 */
+static uint32_t bench_set(void (*set)(void*, uint8_t, uint32_t), uint32_t size, uint32_t off) {
+   uint32_t i, calls = 4 * BENCH_MAX / size;
+   uint64_t start = rdtsc();
+   for (i = 0; i < calls; i++) {
+      set(bench_dst + off, (uint8_t)i, size);
+   }
+   return (uint32_t)((uint64_t)size * calls * 100 / (rdtsc() - start));
+}
+
+static uint32_t bench_copy(void (*copy)(void*, const void*, uint32_t), uint32_t size, uint32_t off) {
+   uint32_t i, calls = 4 * BENCH_MAX / size;
+   uint64_t start = rdtsc();
+   for (i = 0; i < calls; i++) {
+      copy(bench_dst + off, bench_src, size);
+   }
+   return (uint32_t)((uint64_t)size * calls * 100 / (rdtsc() - start));
+}
+
+static void bench(void) {
+   uint32_t size, off;
+   printf("new memset/memcpy use %s\n", cpu_erms ? "rep stosb/movsb (ERMS)" : "rep stosl/movsl plus a byte tail");
+   printf("bytes/cycle x100  size  off  old memset  new memset  old memcpy  new memcpy\n");
+   for (size = 64; size <= BENCH_MAX; size *= 8) {
+      for (off = 0; off < 2; off++) {
+         printf("                %6d  %3d  %10d  %10d  %10d  %10d\n", size, off,
+                bench_set(old_memset, size, off), bench_set(memset, size, off),
+                bench_copy(old_memcpy, size, off), bench_copy(memcpy, size, off));
+      }
+   }
+}
+
+int main(void) {
+   string_init();
+   bool host_erms = cpu_erms;
+   cpu_erms = false;
+   if (check_string() != 0) {
+      return 1;
+   }
+   cpu_erms = true;       // rep movsb/stosb在不支持ERMS的cpu上也能正确执行,只是慢
+   if (check_string() != 0) {
+      return 1;
+   }
+   printf("host cpu ERMS %s\n", host_erms ? "present" : "absent");
+   cpu_erms = false;
+   bench();
+   cpu_erms = true;
+   bench();
+   return 0;
+}
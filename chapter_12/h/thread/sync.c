@@ -23,11 +23,8 @@ void sema_down(struct semaphore* psema) {
 
    //一个自旋锁，来不断判断是否信号量已经被分配出去了。为什么不用if，见书p450。
     while(psema->value == 0) {	// 若value为0,表示已经被别人持有
-        ASSERT(!elem_find(&psema->waiters, &running_thread()->general_tag));
         /* 当前线程不应该已在信号量的waiters队列中 */
-        if (elem_find(&psema->waiters, &running_thread()->general_tag)) {
-	        PANIC("sema_down: thread blocked has been in waiters_list\n");
-        }
+        ASSERT(!elem_in_list(&psema->waiters, &running_thread()->general_tag));
         //如果此时信号量为0，那么就将该线程加入阻塞队列,为什么不用判断是否在阻塞队列中呢？因为线程被阻塞后，会加入阻塞队列，除非被唤醒，否则不会
         //分配到处理器资源，自然也不会重复判断是否有信号量，也不会重复加入阻塞队列
         list_append(&psema->waiters, &running_thread()->general_tag); 
@@ -8,13 +8,24 @@
 #include "print.h"
 #include "sync.h"
 #include "process.h"
+#include "timer.h"
+#include "slab.h"
+#include "perf.h"
 
 #define PG_SIZE 4096
 
 struct task_struct* main_thread;    // 主线程PCB
-struct list thread_ready_list;	    // 就绪队列
+struct task_struct* idle_thread;    // idle线程
 struct list thread_all_list;	    // 所有任务队列
 static struct list_elem* thread_tag;// 用于保存队列中的线程结点
+static struct list dead_list;       // 已经退出、pcb还没有回收的线程,用general_tag串起来
+static struct kmem_cache* task_cache;   // pcb连同内核栈一整页的对象缓存
+
+/* O(1)调度器的就绪队列:每个优先级一个队列,ready_bitmap中第n位为1表示第n级队列非空,
+ * 调度时用bsr找到最高的非空级别,取其队首,同一级别内仍由时钟中断做时间片轮转 */
+static struct list ready_queues[PRIO_LEVELS];
+static uint32_t ready_bitmap[PRIO_LEVELS / 32];
+static bool resched_pending;        // 唤醒了比当前线程级别更高的线程,下次时钟中断时就调度,不必等当前时间片用完
 
 struct lock pid_lock;		    // 分配pid锁
 
@@ -28,11 +39,86 @@ struct task_struct* running_thread() {
    return (struct task_struct*)(esp & 0xfffff000);
 }
 
+/* 线程所属的就绪队列级别 = 基础优先级 + 唤醒提升,超出最高级按最高级算 */
+static uint32_t thread_level(struct task_struct* pthread) {
+   uint32_t level = pthread->priority + pthread->boost;
+   return level < PRIO_LEVELS ? level : PRIO_LEVELS - 1;
+}
+
+/* 把线程放进它所属级别的就绪队列,to_front为真时放队首,否则放队尾 */
+static void ready_enqueue(struct task_struct* pthread, bool to_front) {
+   uint32_t level = thread_level(pthread);
+   pthread->ready_level = level;
+   if (to_front) {
+      list_push(&ready_queues[level], &pthread->general_tag);
+   } else {
+      list_append(&ready_queues[level], &pthread->general_tag);
+   }
+   ready_bitmap[level / 32] |= 1 << (level % 32);
+}
+
+/* 从最高的非空级别队列中弹出一个线程,调用者保证有就绪线程 */
+static struct task_struct* ready_dequeue(void) {
+   int32_t word_idx = PRIO_LEVELS / 32 - 1;
+   while (ready_bitmap[word_idx] == 0) {
+      word_idx--;
+      ASSERT(word_idx >= 0);
+   }
+   uint32_t level;
+   asm ("bsrl %1, %0" : "=r" (level) : "rm" (ready_bitmap[word_idx]));    // 字中最高的1
+   level += word_idx * 32;
+   struct list_elem* tag = list_pop(&ready_queues[level]);
+   if (list_empty(&ready_queues[level])) {
+      ready_bitmap[word_idx] &= ~(1 << (level % 32));
+   }
+   return elem2entry(struct task_struct, general_tag, tag);
+}
+
+/* 判断是否还有就绪线程 */
+bool thread_ready_empty(void) {
+   uint32_t word_idx;
+   for (word_idx = 0; word_idx < PRIO_LEVELS / 32; word_idx++) {
+      if (ready_bitmap[word_idx] != 0) {
+         return false;
+      }
+   }
+   return true;
+}
+
+/* 系统空闲时运行的线程,没有就绪线程时才被schedule放入就绪队列 */
+static void idle(void* arg UNUSED) {
+   while(1) {
+      thread_block(TASK_BLOCKED);     
+      //执行hlt时必须要保证目前处在开中断的情况下
+      asm volatile ("sti; hlt" : : : "memory");
+   }
+}
+
+/* 把新建的线程或进程加入就绪队列队尾 */
+void thread_ready_append(struct task_struct* pthread) {
+   enum intr_status old_status = intr_disable();
+   ASSERT(!thread_in_ready_queue(pthread));
+   ready_enqueue(pthread, false);
+   timer_rearm();
+   intr_set_status(old_status);
+}
+
+/* 判断线程是否在就绪队列中,线程只可能在ready_level那一级的队列里,只用于断言 */
+bool thread_in_ready_queue(struct task_struct* pthread) {
+   return elem_in_list(&ready_queues[pthread->ready_level], &pthread->general_tag);
+}
+
+/* 是否有更高级别的线程在等着运行,时钟中断据此提前调度 */
+bool thread_need_resched(void) {
+   return resched_pending;
+}
+
 /* 由kernel_thread去执行function(func_arg) , 这个函数就是线程中去开启我们要运行的函数*/
 static void kernel_thread(thread_func* function, void* func_arg) {
    /* 执行function前要开中断,避免后面的时钟中断被屏蔽,而无法调度其它线程 */
    intr_enable();
    function(func_arg); 
+   thread_exit();    // function返回了,线程就此结束
 }
 
 /* 分配pid */
@@ -44,6 +130,12 @@ static pid_t allocate_pid(void) {
    return next_pid;
 }
 
+/* fork进程时为其分配pid,因为allocate_pid已经是静态的,别的文件无法调用.
+不想改变函数定义了,故定义fork_pid函数来封装一下。*/
+pid_t fork_pid(void) {
+   return allocate_pid();
+}
+
 /*用于根据传入的线程的pcb地址、要运行的函数地址、函数的参数地址来初始化线程栈中的运行信息，核心就是填入要运行的函数地址与参数 */
 void thread_create(struct task_struct* pthread, thread_func function, void* func_arg) {
    /* 先预留中断使用栈的空间,可见thread.h中定义的结构 */
@@ -87,21 +179,38 @@ void init_thread(struct task_struct* pthread, char* name, int prio) {
    pthread->stack_magic = 0x19870916;	                                // /定义的边界数字，随便选的数字来判断线程的栈是否已经生长到覆盖pcb信息了              
 }
 
+/* 为新任务申请一页pcb,内容不清0,由init_thread或fork复制来初始化,失败返回NULL.
+ * 先回收已退出线程的pcb,刚还回对象缓存的页再分出去时多半还在cache里 */
+struct task_struct* task_alloc(void) {
+   enum intr_status old_status = intr_disable();
+   while (!list_empty(&dead_list)) {
+      struct task_struct* dead = elem2entry(struct task_struct, general_tag, list_pop(&dead_list));
+      intr_set_status(old_status);
+      kmem_cache_free(task_cache, dead);
+      intr_disable();
+   }
+   intr_set_status(old_status);
+   return kmem_cache_alloc(task_cache);
+}
+
+/* 归还还没有运行过的任务的pcb,fork失败时用.运行过的线程不能释放自己正用着的pcb,见thread_exit */
+void task_free(struct task_struct* pthread) {
+   kmem_cache_free(task_cache, pthread);
+}
+
 /* 创建一优先级为prio的线程,线程名为name,线程所执行的函数是function(func_arg) */
 struct task_struct* thread_start(char* name, int prio, thread_func function, void* func_arg) {
 /* pcb都位于内核空间,包括用户进程的pcb也是在内核空间 */
-   struct task_struct* thread = get_kernel_pages(1);    //为线程的pcb申请4K空间的起始地址
+   struct task_struct* thread = task_alloc();    //为线程的pcb申请4K空间的起始地址
 
    init_thread(thread, name, prio);                     //初始化线程的pcb
    thread_create(thread, function, func_arg);           //初始化线程的线程栈
 
-/* 确保之前不在队列中 */
-   ASSERT(!elem_find(&thread_ready_list, &thread->general_tag));
    /* 加入就绪线程队列 */
-   list_append(&thread_ready_list, &thread->general_tag);
+   thread_ready_append(thread);
 
    /* 确保之前不在队列中 */
-   ASSERT(!elem_find(&thread_all_list, &thread->all_list_tag));
+   ASSERT(!elem_in_list(&thread_all_list, &thread->all_list_tag));
    /* 加入全部线程队列 */
    list_append(&thread_all_list, &thread->all_list_tag);
 
@@ -117,43 +226,89 @@ static void make_main_thread(void) {
 
 /* main函数是当前线程,当前线程不在thread_ready_list中,
  * 所以只将其加在thread_all_list中. */
-   ASSERT(!elem_find(&thread_all_list, &main_thread->all_list_tag));
+   ASSERT(!elem_in_list(&thread_all_list, &main_thread->all_list_tag));
    list_append(&thread_all_list, &main_thread->all_list_tag);
 }
 
 /* 实现任务调度 */
 void schedule() {
+   PERF_BEGIN(t);
    ASSERT(intr_get_status() == INTR_OFF);
    struct task_struct* cur = running_thread(); 
-   if (cur->status == TASK_RUNNING) { // 若此线程只是cpu时间片到了,将其加入到就绪队列尾
-      ASSERT(!elem_find(&thread_ready_list, &cur->general_tag));
-      list_append(&thread_ready_list, &cur->general_tag);
-      cur->ticks = cur->priority;     // 重新将当前线程的ticks再重置为其priority;
+   if (cur->status == TASK_RUNNING) { 
+      ASSERT(!thread_in_ready_queue(cur));
       cur->status = TASK_READY;
+      if (cur->ticks == 0) {     // 若此线程只是cpu时间片到了,重置时间片,撤销唤醒提升,将其加入到所在级别就绪队列尾
+         cur->ticks = cur->priority;     // 重新将当前线程的ticks再重置为其priority;
+         cur->boost = 0;
+         ready_enqueue(cur, false);
+      } 
+      else {                     // 时间片没用完就被更高级别的线程抢占,放回队首,轮到这一级时接着用剩下的时间片
+         ready_enqueue(cur, true);
+      }
    } 
    else { 
       /* 若此线程需要某事件发生后才能继续上cpu运行,
       不需要将其加入队列,因为当前线程不在就绪队列中。*/
    }
 
-   ASSERT(!list_empty(&thread_ready_list));
+   /* 如果就绪队列中没有可运行的任务,就唤醒idle,它不享受唤醒提升,留在最低的级别 */
+   if (thread_ready_empty()) {
+      ASSERT(idle_thread->status == TASK_BLOCKED);
+      idle_thread->status = TASK_READY;
+      ready_enqueue(idle_thread, false);
+   }
+   resched_pending = false;
    thread_tag = NULL;	  // thread_tag清空
-/* 将thread_ready_list队列中的第一个就绪线程弹出,准备将其调度上cpu. */
-   thread_tag = list_pop(&thread_ready_list);   
-   struct task_struct* next = elem2entry(struct task_struct, general_tag, thread_tag);
+/* 从最高的非空级别就绪队列中弹出第一个就绪线程,准备将其调度上cpu. */
+   struct task_struct* next = ready_dequeue();
+   thread_tag = &next->general_tag;
    next->status = TASK_RUNNING;
    process_activate(next); //激活任务页表
+#if PERF_STATS
+   if (next->wake_tsc != 0) {
+      perf_add(PERF_WAKEUP, rdtsc() - next->wake_tsc);
+      next->wake_tsc = 0;
+   }
+#endif
+   PERF_END(PERF_SWITCH, t);
    switch_to(cur, next);   
 }
 
+/* 结束当前线程,不再返回.用户进程先释放自己的地址空间和页目录,内核线程交还弹匣中的内存块.
+ * 此时还在用自己的内核栈,pcb不能自己释放,挂到dead_list上,等下次task_alloc时回收 */
+void thread_exit(void) {
+   struct task_struct* cur = running_thread();
+   ASSERT(cur != main_thread && cur != idle_thread);   // main的pcb不是申请来的,idle要一直在
+   if (cur->pgdir != NULL) {
+      process_exit(cur);
+   } 
+   else {
+      block_mags_drain();
+   }
+   intr_disable();
+   list_remove(&cur->all_list_tag);
+   list_append(&dead_list, &cur->general_tag);
+   cur->status = TASK_DIED;
+   schedule();
+   PANIC("thread_exit: dead thread scheduled");
+}
+
 /* 初始化线程环境 */
 void thread_init(void) {
    put_str("thread_init start\n");
-   list_init(&thread_ready_list);
+   uint32_t level;
+   for (level = 0; level < PRIO_LEVELS; level++) {
+      list_init(&ready_queues[level]);
+   }
    list_init(&thread_all_list);
+   list_init(&dead_list);
    lock_init(&pid_lock);
+   task_cache = kmem_cache_create("task_struct", PG_SIZE, PG_SIZE, NULL);
 /* 将当前main函数创建为线程 */
    make_main_thread();
+/* 创建idle线程 */
+   idle_thread = thread_start("idle", IDLE_PRIO, idle, NULL);
    put_str("thread_init done\n");
 }
 
@@ -174,13 +329,17 @@ void thread_unblock(struct task_struct* pthread) {
    enum intr_status old_status = intr_disable();      //涉及队就绪队列的修改，此时绝对不能被切换走
    ASSERT(((pthread->status == TASK_BLOCKED) || (pthread->status == TASK_WAITING) || (pthread->status == TASK_HANGING)));
    if (pthread->status != TASK_READY) {
-      ASSERT(!elem_find(&thread_ready_list, &pthread->general_tag));
-      if (elem_find(&thread_ready_list, &pthread->general_tag)) {
-	      PANIC("thread_unblock: blocked thread in ready_list\n");
-      }
-      list_push(&thread_ready_list, &pthread->general_tag);    // 放到队列的最前面,使其尽快得到调度
+      ASSERT(!thread_in_ready_queue(pthread));   // 阻塞的线程不应在就绪队列中
+      pthread->boost = PRIO_BOOST;               // 刚等到事件的线程多半是交互或IO型,提升级别让它尽快运行
+#if PERF_STATS
+      pthread->wake_tsc = rdtsc();
+#endif
+      ready_enqueue(pthread, true);              // 放到所在级别队列的最前面,使其尽快得到调度
       pthread->status = TASK_READY;
+      if (thread_level(pthread) > thread_level(running_thread())) {
+         resched_pending = true;
+      }
+      timer_rearm();
    } 
    intr_set_status(old_status);
 }
-
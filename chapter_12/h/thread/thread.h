@@ -3,11 +3,16 @@
 #include "stdint.h"
 #include "list.h"
 #include "memory.h"
-   typedef uint16_t pid_t;
+#include "vma.h"
+#include "perf.h"
                                 //定义一种叫thread_fun的函数类型，该类型返回值是空，参数是一个地址(这个地址用来指向自己的参数)。
                                 //这样定义，这个类型就能够具有很大的通用性，很多函数都是这个类型
 typedef void thread_func(void*);
 
+#define PRIO_LEVELS 64                  // 就绪队列的优先级级数,级数越高越先被调度
+#define PRIO_BOOST 8                    // 线程被唤醒时临时提升的级数,时间片用完后撤销
+#define IDLE_PRIO 1                     // idle线程的优先级,低于所有正常线程
+
                                 /* 进程或线程的状态 */
 enum task_status {
    TASK_RUNNING,
@@ -76,28 +81,45 @@ struct task_struct {
    uint32_t* self_kstack;	        // 用于存储线程的栈顶位置，栈顶放着线程要用到的运行信息
    pid_t pid;
    enum task_status status;
-   uint8_t priority;		        // 线程优先级
+   uint8_t priority;		        // 线程优先级,既是时间片长度,也是所在就绪队列的基础级别
+   uint8_t boost;                   // 从thread_block中被唤醒时得到的动态提升,时间片用完后清0
+   uint8_t ready_level;             // 最近一次进入的就绪队列级别
    char name[16];                   //用于存储自己的线程的名字
 
    uint8_t ticks;	                 //线程允许上处理器运行还剩下的滴答值，因为priority不能改变，所以要在其之外另行定义一个值来倒计时
    uint32_t elapsed_ticks;          //此任务自上cpu运行后至今占用了多少cpu嘀嗒数, 也就是此任务执行了多久*/
    struct list_elem general_tag;		//general_tag的作用是用于线程在一般的队列(如就绪队列或者等待队列)中的结点
    struct list_elem all_list_tag;   //all_list_tag的作用是用于线程队列thread_all_list（这个队列用于管理所有线程）中的结点
+   struct list_elem timer_tag;      // 线程睡眠时在时间轮槽中的结点
+   uint32_t wake_tick;              // 睡眠线程到期的嘀嗒数
    uint32_t* pgdir;              // 进程自己页表的虚拟地址
-   struct virtual_addr userprog_vaddr;   // 用户进程的虚拟地址
+   struct vma_tree userprog_vmas;   // 用户进程虚拟地址空间中已经占用的区域
    struct mem_block_desc u_block_desc[DESC_CNT];   // 用户进程内存块描述符
+   struct mem_magazine mags[DESC_CNT];             // 本线程各规格内存块的弹匣,内核线程缓存k_block_descs的块,用户进程缓存u_block_desc的块
+   struct large_table u_large;      // 用户进程大块内存的描述符
+#if PERF_STATS
+   uint64_t wake_tsc;               // 被thread_unblock唤醒时的时间戳,调度上cpu时算出唤醒延迟后清0
+#endif
    uint32_t stack_magic;	       //如果线程的栈无限生长，总会覆盖地pcb的信息，那么需要定义个边界数来检测是否栈已经到了PCB的边界
 };
 
-extern struct list thread_ready_list;
 extern struct list thread_all_list;
+extern struct task_struct* idle_thread;
 void thread_create(struct task_struct* pthread, thread_func function, void* func_arg);
 void init_thread(struct task_struct* pthread, char* name, int prio);
+struct task_struct* task_alloc(void);
+void task_free(struct task_struct* pthread);
 struct task_struct* thread_start(char* name, int prio, thread_func function, void* func_arg);
+void thread_exit(void);
 
 struct task_struct* running_thread(void);
 void schedule(void);
 void thread_init(void);
 void thread_block(enum task_status stat);
 void thread_unblock(struct task_struct* pthread);
+void thread_ready_append(struct task_struct* pthread);
+bool thread_in_ready_queue(struct task_struct* pthread);
+bool thread_need_resched(void);
+bool thread_ready_empty(void);
+pid_t fork_pid(void);
 #endif
@@ -0,0 +1,124 @@
+#include "fork.h"
+#include "process.h"
+#include "memory.h"
+#include "interrupt.h"
+#include "debug.h"
+#include "thread.h"
+#include "string.h"
+#include "global.h"
+#include "list.h"
+#include "vma.h"
+#include "perf.h"
+
+extern void intr_exit(void);
+
+/* 将父进程的pcb、虚拟地址区域拷贝给子进程,再修正子进程自己的字段 */
+static int32_t copy_pcb_vmas_stack0(struct task_struct* child_thread, struct task_struct* parent_thread) {
+/* a 复制pcb所在的整个页,里面包含进程pcb信息及0级的栈,里面包含了返回地址, 然后再单独修改个别部分 */
+   memcpy(child_thread, parent_thread, PG_SIZE);
+   child_thread->pid = fork_pid();
+   child_thread->elapsed_ticks = 0;
+   child_thread->status = TASK_READY;
+   child_thread->ticks = child_thread->priority;   // 为新进程把时间片充满
+   child_thread->boost = 0;
+   /* 复制来的链表结点还是父进程在各队列中的位置,清掉后再由调用者加入队列 */
+   memset(&child_thread->general_tag, 0, sizeof(struct list_elem));
+   memset(&child_thread->all_list_tag, 0, sizeof(struct list_elem));
+   memset(&child_thread->timer_tag, 0, sizeof(struct list_elem));
+   /* 名字后面接上"_fork",name只有16字节,子进程再fork时会放不下,放不下的部分截掉,总以'\0'结尾,不会写到后面的字段 */
+   uint32_t name_len = strlen(child_thread->name);
+   const char* suffix = "_fork";
+   while (name_len < sizeof(child_thread->name) - 1 && *suffix != '\0') {
+      child_thread->name[name_len++] = *suffix++;
+   }
+   child_thread->name[name_len] = '\0';
+   /* 复制来的页目录和大块描述符还是父进程的,先清掉,失败时回收子进程就不会动到父进程的 */
+   child_thread->pgdir = NULL;
+   memset(&child_thread->u_large, 0, sizeof(child_thread->u_large));
+
+/* b 复制父进程的虚拟地址区域树,pcb里复制来的根指针还是父进程的结点 */
+   if (!vma_tree_copy(&child_thread->userprog_vmas, &parent_thread->userprog_vmas)) {
+      return -1;
+   }
+   return 0;
+}
+
+/* 为子进程构建thread_stack和修改返回值 */
+static void build_child_stack(struct task_struct* child_thread) {
+/* a 使子进程pid返回值为0 */
+   /* 获取子进程0级栈栈顶 */
+   struct intr_stack* intr_0_stack = (struct intr_stack*)((uint32_t)child_thread + PG_SIZE - sizeof(struct intr_stack));
+   /* 修改子进程的返回值为0 */
+   intr_0_stack->eax = 0;
+
+/* b 为switch_to 构建 struct thread_stack,将其构建在紧临intr_stack之下的空间*/
+   uint32_t* ret_addr_in_thread_stack  = (uint32_t*)intr_0_stack - 1;
+
+   /***   这三行不是必要的,只是为了梳理thread_stack中的关系 ***/
+   uint32_t* esi_ptr_in_thread_stack = (uint32_t*)intr_0_stack - 2; 
+   uint32_t* edi_ptr_in_thread_stack = (uint32_t*)intr_0_stack - 3; 
+   uint32_t* ebx_ptr_in_thread_stack = (uint32_t*)intr_0_stack - 4; 
+   /**********************************************************/
+
+   /* ebp在thread_stack中的地址便是当时的esp(0级栈的栈顶),
+   即esp为"(uint32_t*)intr_0_stack - 5" */
+   uint32_t* ebp_ptr_in_thread_stack = (uint32_t*)intr_0_stack - 5; 
+
+   /* switch_to的返回地址更新为intr_exit,直接从中断返回 */
+   *ret_addr_in_thread_stack = (uint32_t)intr_exit;
+
+   /* 下面这两行赋值只是为了使构建的thread_stack更加清晰,其实也不需要,
+    * 因为在进入intr_exit后一系列的pop会把寄存器中的数据覆盖 */
+   *ebp_ptr_in_thread_stack = *ebx_ptr_in_thread_stack =\
+   *edi_ptr_in_thread_stack = *esi_ptr_in_thread_stack = 0;
+   /*********************************************************/
+
+   /* 把构建的thread_stack的栈顶做为switch_to恢复数据时的栈顶 */
+   child_thread->self_kstack = ebp_ptr_in_thread_stack;	    
+}
+
+/* fork子进程,内核线程不可直接调用.父子进程的用户内存写时复制共享,fork本身只复制pcb、区域树和页表 */
+pid_t sys_fork(void) {
+   PERF_BEGIN(t);
+   struct task_struct* parent_thread = running_thread();
+   struct task_struct* child_thread = task_alloc();    // 为子进程创建pcb(task_struct结构)
+   if (child_thread == NULL) {
+      return -1;
+   }
+   ASSERT(INTR_OFF == intr_get_status() && parent_thread->pgdir != NULL);
+
+   if (copy_pcb_vmas_stack0(child_thread, parent_thread) == -1) {
+      goto fail;
+   }
+   child_thread->pgdir = create_page_dir();
+   if (child_thread->pgdir == NULL) {
+      goto fail;
+   }
+   if (!user_pgdir_cow_copy(child_thread->pgdir)) {
+      goto fail;
+   }
+   block_desc_fork(child_thread, parent_thread);
+   if (!large_table_copy(&child_thread->u_large, &parent_thread->u_large)) {
+      goto fail;
+   }
+   build_child_stack(child_thread);
+
+   /* 添加到全部线程队列,再加入就绪队列 */
+   ASSERT(!elem_in_list(&thread_all_list, &child_thread->all_list_tag));
+   list_append(&thread_all_list, &child_thread->all_list_tag);
+   thread_ready_append(child_thread);
+
+   PERF_END(PERF_FORK, t);
+   return child_thread->pid;    // 返回子进程的pid
+
+/* 失败时把子进程已经拿到的都还回去:已复制的页表连同对页框的引用计数、页目录、区域树和pcb */
+fail:
+   if (child_thread->pgdir != NULL) {
+      process_exit(child_thread);
+   } 
+   else {
+      vma_tree_destroy(&child_thread->userprog_vmas);
+   }
+   task_free(child_thread);
+   return -1;
+}
@@ -2,35 +2,50 @@
 #include "thread.h"
 #include "global.h"   //定义了PG_SIZE
 #include "memory.h"
-#include "bitmap.h"
+#include "vma.h"
 #include "string.h"
 #include "tss.h"
 #include "console.h"
 #include "debug.h"
 #include "interrupt.h"
+#include "slab.h"
+#include "perf.h"
 
-//用于初始化进程pcb中的用于管理自己虚拟地址空间的虚拟内存池结构体
-void create_user_vaddr_bitmap(struct task_struct* user_prog) {
-   user_prog->userprog_vaddr.vaddr_start = USER_VADDR_START;
-   uint32_t bitmap_pg_cnt = DIV_ROUND_UP((0xc0000000 - USER_VADDR_START) / PG_SIZE / 8 , PG_SIZE);      //计算出管理用于进程那么大的虚拟地址的
-                                                                                                        //位图需要多少页的空间来存储（向上取整结果）
-   user_prog->userprog_vaddr.vaddr_bitmap.bits = get_kernel_pages(bitmap_pg_cnt);                       //申请位图空间
-   user_prog->userprog_vaddr.vaddr_bitmap.btmp_bytes_len = (0xc0000000 - USER_VADDR_START) / PG_SIZE / 8;   //计算出位图长度（字节单位）
-   bitmap_init(&user_prog->userprog_vaddr.vaddr_bitmap);        //初始化位图
+//用于初始化进程pcb中管理自己虚拟地址空间的区域树,不再给每个进程申请24页的虚拟地址位图,
+//区域结点按需申请,一个进程通常只有寥寥几个区域.栈底以下USER_STACK_SIZE留给用户栈,不参与分配.
+//再往下一页登记给用户态malloc放状态,页框在第一次访问时才分配,已经清0,正好是空堆的状态
+void create_user_vaddr_space(struct task_struct* user_prog) {
+   vma_tree_init(&user_prog->userprog_vmas, USER_VADDR_START, USER_HEAP_VADDR);
+   if (!vma_insert(&user_prog->userprog_vmas, USER_HEAP_VADDR, USER_HEAP_VADDR + PG_SIZE, VM_READ | VM_WRITE)) {
+      console_put_str("create_user_vaddr_space: vma_insert failed!");
+   }
+}
+
+
+static struct kmem_cache* pgdir_cache;  // 页目录的对象缓存
+
+/* 页目录的构造函数:用户部分清0,内核部分从当前页目录的768号项到1022号项复制过来,最后一项填自己的物理地址,以此来动态操作页目录表.
+ * 进程退出时用户部分又被清回0,内核部分的页目录项从不改变,所以释放的页目录再分配出去时不用重新构造 */
+static void pgdir_ctor(void* obj) {
+   uint32_t* page_dir_vaddr = obj;
+   memset(page_dir_vaddr, 0, 768 * 4);
+   memcpy((uint32_t*)((uint32_t)page_dir_vaddr + 768*4), (uint32_t*)(0xfffff000 + 768 * 4), 255 * 4);
+   uint32_t new_page_dir_phy_addr = addr_v2p((uint32_t)page_dir_vaddr);     //将进程的页目录表的虚拟地址，转换成物理地址
+   page_dir_vaddr[1023] = new_page_dir_phy_addr | PG_US_S | PG_RW_W | PG_P_1;     // 只许内核经由它访问页表
 }
 
+/* 初始化进程相关的对象缓存 */
+void process_init(void) {
+   pgdir_cache = kmem_cache_create("pgdir", PG_SIZE, PG_SIZE, pgdir_ctor);
+}
 
-//用于为进程创建页目录表，并初始化（系统映射+页目录表最后一项是自己的物理地址，以此来动态操作页目录表），成功后，返回页目录表虚拟地址，失败返回空地址
+//用于为进程创建页目录表,页目录从对象缓存中取,已经是构造好的，成功后，返回页目录表虚拟地址，失败返回空地址
 uint32_t* create_page_dir(void) {
-   uint32_t* page_dir_vaddr = get_kernel_pages(1);  //用户进程的页表不能让用户直接访问到,所以在内核空间来申请
+   uint32_t* page_dir_vaddr = kmem_cache_alloc(pgdir_cache);  //用户进程的页表不能让用户直接访问到,所以在内核空间来申请
    if (page_dir_vaddr == NULL) {
-        console_put_str("create_page_dir: get_kernel_page failed!");
+        console_put_str("create_page_dir: kmem_cache_alloc failed!");
         return NULL;
    }
-   //将内核页目录表的768号项到1022号项复制过来
-   memcpy((uint32_t*)((uint32_t)page_dir_vaddr + 768*4), (uint32_t*)(0xfffff000 + 768 * 4), 255 * 4);
-   uint32_t new_page_dir_phy_addr = addr_v2p((uint32_t)page_dir_vaddr);     //将进程的页目录表的虚拟地址，转换成物理地址
-   page_dir_vaddr[1023] = new_page_dir_phy_addr | PG_US_U | PG_RW_W | PG_P_1;   //页目录表最后一项填自己的地址，为的是动态操作页表
    return page_dir_vaddr;
 }
 
@@ -49,18 +64,20 @@ void start_process(void* filename_) {
    proc_stack->eip = function;	 //设定要执行的函数（进程）的地址
    proc_stack->cs = SELECTOR_U_CODE;
    proc_stack->eflags = (EFLAGS_IOPL_0 | EFLAGS_MBS | EFLAGS_IF_1);     //设置用户态下的eflages的相关字段
-    //下面这一句是在初始化中断栈中的栈顶位置，我们先为虚拟地址0xc0000000 - 0x1000申请了个物理页，然后将虚拟地址+4096置为栈顶
-   proc_stack->esp = (void*)((uint32_t)get_a_page(PF_USER, USER_STACK3_VADDR) + PG_SIZE) ;
+    //下面这一句是在初始化中断栈中的栈顶位置，栈页不再预先分配，进程第一次压栈时由缺页处理分配，栈向下超出一页时也同样按需增长
+   proc_stack->esp = (void*)(USER_STACK3_VADDR + PG_SIZE);
    proc_stack->ss = SELECTOR_U_DATA; 
    asm volatile ("movl %0, %%esp; jmp intr_exit" : : "g" (proc_stack) : "memory");
 }
 
+/* 当前cr3中装载的页目录,NULL表示内核页目录0x100000.只有一个cpu,所以只有一份 */
+static uint32_t* loaded_pgdir;
+
 /* 激活页表 */
 void page_dir_activate(struct task_struct* p_thread) {
 /********************************************************
- * 执行此函数时,当前任务可能是线程。
- * 之所以对线程也要重新安装页表, 原因是上一次被调度的可能是进程,
- * 否则不恢复页表的话,线程就会使用进程的页表了。
+ * p_thread可能是内核线程,此时装载内核自己的页目录。
+ * 调度时内核线程并不调用这里,而是沿用上一个进程的页表,见process_activate。
  ********************************************************/
 
 /* 若为内核线程,需要重新填充页表为0x100000 */
@@ -68,35 +85,58 @@ void page_dir_activate(struct task_struct* p_thread) {
    if (p_thread->pgdir != NULL)	{    //如果不为空，说明要调度的是个进程，那么就要执行加载页表，所以先得到进程页目录表的物理地址
         pagedir_phy_addr = addr_v2p((uint32_t)p_thread->pgdir);
    }
+   PERF_BEGIN(t);
    asm volatile ("movl %0, %%cr3" : : "r" (pagedir_phy_addr) : "memory");   //更新页目录寄存器cr3,使新页表生效
+   PERF_END(PERF_CR3_LOAD, t);
+   loaded_pgdir = p_thread->pgdir;
 }
 
 
 //用于加载进程自己的页目录表，同时更新进程自己的0特权级esp0到TSS中
 void process_activate(struct task_struct* p_thread) {
     ASSERT(p_thread != NULL);
-   /* 激活该进程或线程的页表 */
-    page_dir_activate(p_thread);
-   /* 内核线程特权级本身就是0,处理器进入中断时并不会从tss中获取0特权级栈地址,故不需要更新esp0 */
-    if (p_thread->pgdir)
-        update_tss_esp(p_thread);   /* 更新该进程的esp0,用于此进程被中断时保留上下文 */
+   /* 内核线程只访问内核空间,而所有页目录的内核部分都相同,所以沿用当前装载的页表即可,
+    * 不写cr3也就不会冲掉tlb,下次切回同一个进程时连用户部分的tlb表项也还在(类似linux的lazy tlb).
+    * 内核线程特权级本身就是0,处理器进入中断时并不会从tss中获取0特权级栈地址,故也不需要更新esp0 */
+    if (p_thread->pgdir == NULL) {
+        return;
+    }
+   /* 激活该进程的页表,已经装载的就不用再装 */
+    if (p_thread->pgdir != loaded_pgdir) {
+        page_dir_activate(p_thread);
+    }
+    update_tss_esp(p_thread);   /* 更新该进程的esp0,用于此进程被中断时保留上下文 */
 }
 
 //用于创建进程，参数是进程要执行的函数与他的名字
 void process_execute(void* filename, char* name) { 
     /* pcb内核的数据结构,由内核来维护进程信息,因此要在内核内存池中申请 */
-    struct task_struct* thread = get_kernel_pages(1);
+    struct task_struct* thread = task_alloc();
     init_thread(thread, name, default_prio); 
-    create_user_vaddr_bitmap(thread);
+    create_user_vaddr_space(thread);
     thread_create(thread, start_process, filename);
     thread->pgdir = create_page_dir();
     block_desc_init(thread->u_block_desc);
     
     enum intr_status old_status = intr_disable();
-    ASSERT(!elem_find(&thread_ready_list, &thread->general_tag));
-    list_append(&thread_ready_list, &thread->general_tag);
+    thread_ready_append(thread);
 
-    ASSERT(!elem_find(&thread_all_list, &thread->all_list_tag));
+    ASSERT(!elem_in_list(&thread_all_list, &thread->all_list_tag));
     list_append(&thread_all_list, &thread->all_list_tag);
     intr_set_status(old_status);
-}
\ No newline at end of file
+}
+
+/* 释放进程的用户空间和页目录,之后它就和内核线程一样只用内核空间了.当前进程退出时由thread_exit调用,
+ * fork失败时也用它回收还没运行过的子进程,user_pgdir_free按装载着的页目录回收,所以先临时换上它的页目录 */
+void process_exit(struct task_struct* p_thread) {
+   struct task_struct* cur = running_thread();
+   ASSERT(p_thread->pgdir != NULL);
+   page_dir_activate(p_thread);
+   user_pgdir_free();
+   vma_tree_destroy(&p_thread->userprog_vmas);
+   large_table_destroy(&p_thread->u_large);
+   uint32_t* pgdir = p_thread->pgdir;
+   p_thread->pgdir = NULL;
+   page_dir_activate(cur);     // 换回当前任务的页目录,退出的就是当前进程时换上内核页目录,cr3不能还指着要释放的页目录
+   kmem_cache_free(pgdir_cache, pgdir);
+}
@@ -6,6 +6,8 @@
 #include "console.h"
 #include "string.h"
 #include "memory.h"
+#include "timer.h"
+#include "fork.h"
 
 #define syscall_nr 32 
 typedef void* syscall;
@@ -22,6 +24,12 @@ uint32_t sys_write(char* str) {
    	return strlen(str);
 }
 
+/* 让当前任务睡眠m_seconds毫秒 */
+uint32_t sys_sleep(uint32_t m_seconds) {
+	mtime_sleep(m_seconds);
+	return 0;
+}
+
 /* 初始化系统调用 */
 void syscall_init(void) {
 	put_str("syscall_init start\n");
@@ -29,5 +37,11 @@ void syscall_init(void) {
 	syscall_table[SYS_WRITE] = sys_write;
 	syscall_table[SYS_MALLOC] = sys_malloc;
    	syscall_table[SYS_FREE] = sys_free;
+	syscall_table[SYS_SLEEP] = sys_sleep;
+	syscall_table[SYS_FORK] = sys_fork;
+	syscall_table[SYS_MEMINFO] = sys_meminfo;
+	syscall_table[SYS_EXIT] = thread_exit;
+	syscall_table[SYS_MMAP] = sys_mmap;
+	syscall_table[SYS_MUNMAP] = sys_munmap;
 	put_str("syscall_init done\n");
 }
@@ -4,4 +4,5 @@
 void syscall_init(void);
 uint32_t sys_getpid(void);
 uint32_t sys_write(char* str);
+uint32_t sys_sleep(uint32_t m_seconds);
 #endif